@@ -0,0 +1,213 @@
+/**
+ * Scanner throughput benchmark
+ *
+ * Scans generated inputs, or the files named on the command line, with
+ * scanToken() and prints the best MB/s of several runs. It links against
+ * the scanner alone:
+ *
+ *   cc -O2 -I. -o scanbench bench/scanbench.c scanner.c
+ *   ./scanbench                  every generated input
+ *   ./scanbench script.fein ...  the given files
+ *
+ * Add -mavx2 for 32-byte blocks or -DNO_SIMD_SCANNER for the scalar
+ * scanner. The generated inputs are the kinds in the SIMD scanner table
+ * in README.md, plus the identifier-heavy input of its keyword lookup.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+#define INPUT_SIZE (8 * 1024 * 1024)
+#define RUNS 10
+
+/**
+ * Structure of a growing source text
+ *
+ * chars "the text, NUL-terminated"
+ * count "bytes written"
+ * capacity "bytes allocated"
+ */
+typedef struct {
+    char* chars;
+    size_t count;
+    size_t capacity;
+} Text;
+
+// function to append a string to a text
+static void append(Text* text, const char* chars) {
+    size_t length = strlen(chars);
+    if (text->count + length + 1 > text->capacity) {
+        text->capacity = (text->count + length + 1) * 2;
+        text->chars = realloc(text->chars, text->capacity);
+        if (text->chars == NULL) {
+            fprintf(stderr, "Not enough memory for the input.\n");
+            exit(74);
+        }
+    }
+    memcpy(text->chars + text->count, chars, length + 1);
+    text->count += length;
+}
+
+// function to generate lines of long comments
+static void generateComments(Text* text) {
+    while (text->count < INPUT_SIZE) {
+        append(text, "// The scanner skips the rest of this line in blocks, "
+                     "up to the newline that ends the comment.\n");
+        append(text, "var x = 1;\n");
+    }
+}
+
+// function to generate long string literals
+static void generateStrings(Text* text) {
+    while (text->count < INPUT_SIZE) {
+        append(text, "print \"a string literal long enough to span several "
+                     "blocks of the SIMD scanner before its quote\";\n");
+    }
+}
+
+// function to generate deeply indented code
+static void generateIndentation(Text* text) {
+    while (text->count < INPUT_SIZE) {
+        append(text, "                                        "
+                     "if (a < b) {\n");
+        append(text, "                                                "
+                     "a = a + 1;\n");
+        append(text, "                                        }\n");
+    }
+}
+
+// function to generate dense code with short names and single spaces
+static void generateDense(Text* text) {
+    while (text->count < INPUT_SIZE) {
+        append(text, "var a = b * 2 + c; if (a > 10) { a = a - 1; } "
+                     "print a;\n");
+    }
+}
+
+/**
+ * function to generate words, about a third of them keywords
+ *
+ * A fixed pseudo-random sequence picks the words, so the keyword lookup
+ * sees every keyword and identifiers of many lengths in no set order.
+ */
+static void generateIdentifiers(Text* text) {
+    static const char* keywords[] = {
+        "and", "class", "const", "else", "false", "for", "fun", "if", "nil",
+        "or", "print", "return", "super", "this", "true", "var", "while",
+    };
+    static const char* identifiers[] = {
+        "i", "n", "count", "total", "result", "index", "value", "left",
+        "right", "node", "parent", "children", "buffer", "length", "offset",
+        "current", "previous", "scanner", "tokenType", "lineNumber",
+        "forward", "variable", "classify", "printer", "orange", "iffy",
+    };
+    size_t keywordCount = sizeof(keywords) / sizeof(keywords[0]);
+    size_t identifierCount = sizeof(identifiers) / sizeof(identifiers[0]);
+
+    uint32_t state = 2463534242u;
+    int words = 0;
+    while (text->count < INPUT_SIZE) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        if (state % 3 == 0) {
+            append(text, keywords[(state / 3) % keywordCount]);
+        } else {
+            append(text, identifiers[(state / 3) % identifierCount]);
+        }
+        append(text, ++words % 12 == 0 ? "\n" : " ");
+    }
+}
+
+/**
+ * Structure of a generated benchmark input
+ *
+ * name "label printed with the result"
+ * generate "function that writes the input"
+ */
+typedef struct {
+    const char* name;
+    void (*generate)(Text* text);
+} Input;
+
+static const Input inputs[] = {
+    {"Long comments", generateComments},
+    {"Long strings", generateStrings},
+    {"Deep indentation", generateIndentation},
+    {"Dense code, short names", generateDense},
+    {"Identifiers and keywords", generateIdentifiers},
+};
+
+// function to read the seconds of CPU time the process has used
+static double cpuSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// function to scan a source RUNS times and print its best throughput
+static void benchmark(const char* name, const char* source, size_t size) {
+    double best = 0;
+    long tokens = 0;
+    int lines = 0;
+    for (int run = 0; run < RUNS; run++) {
+        double start = cpuSeconds();
+        initScanner(source);
+        Token token;
+        tokens = 0;
+        do {
+            token = scanToken();
+            tokens++;
+        } while (token.type != TOKEN_EOF);
+        double elapsed = cpuSeconds() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+        lines = token.line;
+    }
+
+    double megabytes = (double)size / 1e6;
+    printf("%-28s %6.1f MB %10ld tokens %8d lines %8.0f MB/s\n",
+           name, megabytes, tokens, lines, megabytes / best);
+}
+
+// function to read a whole file into a text
+static void readInput(const char* path, Text* text) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    append(text, "");
+    char buffer[65536];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer) - 1, file)) > 0) {
+        buffer[read] = '\0';
+        append(text, buffer);
+    }
+    fclose(file);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            Text text = {NULL, 0, 0};
+            readInput(argv[i], &text);
+            benchmark(argv[i], text.chars, text.count);
+            free(text.chars);
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        Text text = {NULL, 0, 0};
+        inputs[i].generate(&text);
+        benchmark(inputs[i].name, text.chars, text.count);
+        free(text.chars);
+    }
+    return 0;
+}
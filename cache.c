@@ -0,0 +1,377 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "cache.h"
+
+#ifdef BYTECODE_CACHE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/**
+ * Layout of a cache file, in the byte order of the machine that wrote it:
+ *
+ *   CacheHeader
+ *   line runs      lineRunCount x (uint32 line, uint32 bytes)
+ *   constants      constantCount x (uint8 tag, 8 byte double |
+ *                                   uint32 length, bytes)
+ *   global names   globalCount x (uint32 length, bytes), in slot order
+ *   code           codeSize bytes
+ *
+ * The code comes last, unaligned, and is run straight out of the mapping.
+ */
+
+/**
+ * Structure of the fixed header at the start of a cache file
+ *
+ * magic "CACHE_MAGIC"
+ * version "CACHE_VERSION of the fcc that wrote it"
+ * sourceHash "hashSource() of the script it was compiled from"
+ * checksum "FNV-1a of every byte after the header"
+ * codeSize "bytes of code"
+ * lineRunCount "number of runs in the line table"
+ * constantCount "number of constants"
+ * globalCount "number of global names"
+ * maxStack "the chunk's maxStack"
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t checksum;
+    uint32_t codeSize;
+    uint32_t lineRunCount;
+    uint32_t constantCount;
+    uint32_t globalCount;
+    uint32_t maxStack;
+} CacheHeader;
+
+#define CACHE_MAGIC "FCCB"
+
+/**
+ * Enum for the tag in front of each cached constant
+ */
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+} ConstantTag;
+
+/**
+ * Structure of the bytes of a cache file being built
+ *
+ * bytes "the file contents"
+ * count "bytes in use"
+ * capacity "bytes allocated"
+ */
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+/**
+ * Structure to read a mapped cache file with bounds checks
+ *
+ * bytes "start of the file"
+ * size "size of the file"
+ * offset "where the next read starts"
+ * failed "a read ran past the end"
+ */
+typedef struct {
+    const uint8_t* bytes;
+    size_t size;
+    size_t offset;
+    bool failed;
+} Reader;
+
+// function to hash bytes with 64-bit FNV-1a
+static uint64_t fnv1a(const uint8_t* bytes, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// function to hash the source a cache was compiled from
+uint64_t hashSource(const char* source, size_t length) {
+    return fnv1a((const uint8_t*)source, length);
+}
+
+// function to append bytes to a buffer
+static void writeBytes(Buffer* buffer, const void* bytes, size_t count) {
+    if (buffer->capacity < buffer->count + count) {
+        size_t oldCapacity = buffer->capacity;
+        while (buffer->capacity < buffer->count + count) {
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        }
+        buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes,
+                                   oldCapacity, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+// function to append a 32-bit number to a buffer
+static void writeU32(Buffer* buffer, uint32_t value) {
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+// function to append a string as its length and bytes
+static void writeString(Buffer* buffer, ObjString* string) {
+    writeU32(buffer, (uint32_t)string->length);
+    writeBytes(buffer, string->chars, string->length);
+}
+
+/**
+ * function to check that a cache file may be written at path
+ *
+ * Only a missing file or an earlier cache file is replaced, so a file that
+ * merely has the cache's name is never overwritten.
+ */
+static bool replaceable(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return errno == ENOENT;
+
+    char magic[sizeof(CACHE_MAGIC) - 1];
+    bool isCache = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                   memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return isCache;
+}
+
+/**
+ * function to write a compiled chunk to a cache file
+ *
+ * The file is written under a temporary name and renamed into place, so a
+ * script starting at the same time never maps half a file. Returns false
+ * if the chunk holds a constant that cannot be cached, path holds some
+ * other file or the write fails.
+ */
+bool writeCache(const char* path, uint64_t sourceHash, Chunk* chunk) {
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.codeSize = (uint32_t)chunk->count;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.globalCount = (uint32_t)vm.globalNames.count;
+    header.maxStack = (uint32_t)chunk->maxStack;
+
+    Buffer buffer = {NULL, 0, 0};
+    writeBytes(&buffer, &header, sizeof(header));
+
+    for (int i = 0; i < chunk->lineCount; i++) {
+        int end = i + 1 < chunk->lineCount ? chunk->lines[i + 1].offset
+                                           : chunk->count;
+        writeU32(&buffer, (uint32_t)chunk->lines[i].line);
+        writeU32(&buffer, (uint32_t)(end - chunk->lines[i].offset));
+    }
+    header.lineRunCount = (uint32_t)chunk->lineCount;
+
+    bool cacheable = true;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NUMBER(value)) {
+            uint8_t tag = CONSTANT_NUMBER;
+            double number = AS_NUMBER(value);
+            writeBytes(&buffer, &tag, 1);
+            writeBytes(&buffer, &number, sizeof(number));
+        } else if (IS_STRING(value)) {
+            uint8_t tag = CONSTANT_STRING;
+            writeBytes(&buffer, &tag, 1);
+            writeString(&buffer, AS_STRING(value));
+        } else {
+            cacheable = false;
+        }
+    }
+
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeString(&buffer, AS_STRING(vm.globalNames.values[i]));
+    }
+    writeBytes(&buffer, chunk->code, chunk->count);
+
+    header.checksum = fnv1a(buffer.bytes + sizeof(header),
+                            buffer.count - sizeof(header));
+    memcpy(buffer.bytes, &header, sizeof(header));
+
+    bool written = false;
+    if (cacheable && replaceable(path)) {
+        char temporary[4096];
+        int length = snprintf(temporary, sizeof(temporary), "%s.%ld.tmp",
+                              path, (long)getpid());
+        FILE* file = length < (int)sizeof(temporary)
+                         ? fopen(temporary, "wb") : NULL;
+        if (file != NULL) {
+            written = fwrite(buffer.bytes, 1, buffer.count, file) ==
+                      buffer.count;
+            written = fclose(file) == 0 && written;
+            written = written && rename(temporary, path) == 0;
+            if (!written) remove(temporary);
+        }
+    }
+
+    FREE_ARRAY(uint8_t, buffer.bytes, buffer.capacity);
+    return written;
+}
+
+// function to take the next count bytes of a cache file, NULL past its end
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (reader->failed || count > reader->size - reader->offset) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+// function to read a 32-bit number from a cache file
+static uint32_t readU32(Reader* reader) {
+    uint32_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// function to read a string written by writeString() and intern it
+static ObjString* readString(Reader* reader) {
+    uint32_t length = readU32(reader);
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL || length > INT32_MAX) return NULL;
+    return copyString((const char*)chars, (int)length);
+}
+
+/**
+ * function to read the tables of a cache file into a chunk
+ *
+ * Global names get their slots in file order. That only gives the slots
+ * the code was compiled against in a VM that has no other globals yet, so
+ * any other slot rejects the file.
+ */
+static bool readTables(Reader* reader, CacheHeader* header, Chunk* chunk) {
+    uint32_t covered = 0;
+    for (uint32_t i = 0; i < header->lineRunCount; i++) {
+        int line = (int)readU32(reader);
+        uint32_t count = readU32(reader);
+        if (reader->failed || count == 0 ||
+            count > header->codeSize - covered) {
+            return false;
+        }
+        addLine(chunk, (int)covered, line);
+        covered += count;
+    }
+    if (covered != header->codeSize) return false;
+
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        const uint8_t* tag = readBytes(reader, 1);
+        if (tag == NULL) return false;
+        if (*tag == CONSTANT_NUMBER) {
+            const uint8_t* bytes = readBytes(reader, sizeof(double));
+            if (bytes == NULL) return false;
+            double number;
+            memcpy(&number, bytes, sizeof(number));
+            writeValueArray(&chunk->constants, NUMBER_VAL(number));
+        } else if (*tag == CONSTANT_STRING) {
+            ObjString* string = readString(reader);
+            if (string == NULL) return false;
+            push(OBJ_VAL(string));
+            writeValueArray(&chunk->constants, OBJ_VAL(string));
+            writeBarrier(OBJ_VAL(string));
+            pop();
+        } else {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        ObjString* name = readString(reader);
+        if (name == NULL || globalSlot(name) != (int)i) return false;
+    }
+    return true;
+}
+
+/**
+ * function to load a cache file written by writeCache()
+ *
+ * The file is mapped private and writable: the code is used in place, and
+ * quickening's writes go to copy-on-write pages. A file that is missing,
+ * from another fcc version, compiled from other source, damaged or cut
+ * short is rejected, and nothing is left allocated.
+ */
+bool loadCache(const char* path, uint64_t sourceHash, CachedChunk* cached) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) == -1 ||
+        status.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)status.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    CacheHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    Reader reader = {mapping, size, sizeof(header), false};
+    Chunk* chunk = &cached->chunk;
+    initChunk(chunk);
+    // Roots the constants for the collector while they are read.
+    vm.chunk = chunk;
+
+    bool valid =
+        memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == CACHE_VERSION &&
+        header.sourceHash == sourceHash &&
+        header.codeSize > 0 && header.codeSize <= INT32_MAX &&
+        fnv1a((uint8_t*)mapping + sizeof(header), size - sizeof(header)) ==
+            header.checksum &&
+        readTables(&reader, &header, chunk);
+
+    uint8_t* code = NULL;
+    if (valid) {
+        code = (uint8_t*)readBytes(&reader, header.codeSize);
+        valid = code != NULL && reader.offset == size &&
+                code[header.codeSize - 1] == OP_RETURN;
+    }
+
+    if (!valid) {
+        FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+        freeValueArray(&chunk->constants);
+        munmap(mapping, size);
+        vm.chunk = NULL;
+        return false;
+    }
+
+    chunk->code = code;
+    chunk->count = (int)header.codeSize;
+    chunk->capacity = chunk->count;
+    chunk->maxStack = (int)header.maxStack;
+    cached->mapping = mapping;
+    cached->size = size;
+    return true;
+}
+
+// function to free a chunk loaded by loadCache() and unmap its file
+void freeCachedChunk(CachedChunk* cached) {
+    FREE_ARRAY(LineStart, cached->chunk.lines, cached->chunk.lineCapacity);
+    freeValueArray(&cached->chunk.constants);
+    munmap(cached->mapping, cached->size);
+    if (vm.chunk == &cached->chunk) vm.chunk = NULL;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef fcc_cache_h
+#define fcc_cache_h
+
+#include <stddef.h>
+
+#include "chunk.h"
+
+#ifdef BYTECODE_CACHE
+
+// Format version of cache files. Bump it whenever the bytecode changes.
+#define CACHE_VERSION 2
+
+// Suffix appended to a script's path to name its cache file.
+#define CACHE_SUFFIX ".fcccache"
+
+/**
+ * Structure of a chunk loaded from a cache file
+ *
+ * chunk "the chunk; its code points into the mapping"
+ * mapping "the cache file mapped copy-on-write, so quickening can patch
+ *          the code without touching the file"
+ * size "size of the mapping in bytes"
+ */
+typedef struct {
+    Chunk chunk;
+    void* mapping;
+    size_t size;
+} CachedChunk;
+
+// function declarations for the bytecode cache
+uint64_t hashSource(const char* source, size_t length);
+bool writeCache(const char* path, uint64_t sourceHash, Chunk* chunk);
+bool loadCache(const char* path, uint64_t sourceHash, CachedChunk* cached);
+void freeCachedChunk(CachedChunk* cached);
+
+#endif
+
+#endif
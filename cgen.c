@@ -0,0 +1,513 @@
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#include "cgen.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/**
+ * Helpers every generated file starts with. They mirror run() so the
+ * native program prints the same output and the same runtime errors.
+ */
+static const char* preamble =
+    "#include <stdarg.h>\n"
+    "#include <stdio.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#include \"common.h\"\n"
+    "#include \"memory.h\"\n"
+    "#include \"object.h\"\n"
+    "#include \"value.h\"\n"
+    "#include \"vm.h\"\n"
+    "\n"
+    "static inline double fromBits(uint64_t bits) {\n"
+    "  double number;\n"
+    "  memcpy(&number, &bits, sizeof(number));\n"
+    "  return number;\n"
+    "}\n"
+    "\n"
+    "static inline bool isFalsey(Value value) {\n"
+    "  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));\n"
+    "}\n"
+    "\n"
+    "static inline int fail(int line, const char* format, ...) {\n"
+    "  va_list args;\n"
+    "  va_start(args, format);\n"
+    "  vfprintf(stderr, format, args);\n"
+    "  va_end(args);\n"
+    "  fputs(\"\\n\", stderr);\n"
+    "  fprintf(stderr, \"[line %d] in script\\n\", line);\n"
+    "  return 70;\n"
+    "}\n"
+    "\n"
+    "static inline void concatenate(Value* sp) {\n"
+    "  sp[-2] = OBJ_VAL(concatenateStrings());\n"
+    "}\n"
+    "\n"
+    "#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))\n"
+    "#define BINARY(line, valueType, op) \\\n"
+    "  do { \\\n"
+    "    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) { \\\n"
+    "      return fail(line, \"Operands must be numbers.\"); \\\n"
+    "    } \\\n"
+    "    double b = AS_NUMBER(sp[-1]); \\\n"
+    "    double a = AS_NUMBER(sp[-2]); \\\n"
+    "    sp[-2] = valueType(a op b); \\\n"
+    "    sp--; \\\n"
+    "  } while (false)\n"
+    "#define BINARY_NN(valueType, op) \\\n"
+    "  do { \\\n"
+    "    sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \\\n"
+    "    sp--; \\\n"
+    "  } while (false)\n"
+    "#define GLOBAL(line, slot, name) \\\n"
+    "  do { \\\n"
+    "    if (IS_UNDEFINED(globals[slot])) { \\\n"
+    "      return fail(line, \"Undefined variable '%s'.\", name); \\\n"
+    "    } \\\n"
+    "  } while (false)\n"
+    "\n";
+
+// function to write bytes as the inside of a C string literal
+static void writeCString(FILE* out, const char* chars, int length) {
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c < ' ' || c >= 0x7f || c == '?') {
+            // Octal escapes are always three digits, so they never run
+            // into the next character; '?' would start a trigraph.
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+// function to write a number so the C compiler gets exactly the same bits
+static void writeNumber(FILE* out, double number) {
+    if (isfinite(number) && !(number == 0 && signbit(number))) {
+        fprintf(out, "NUMBER_VAL(%.17g)", number);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        fprintf(out, "NUMBER_VAL(fromBits(0x%016" PRIx64 "u))", bits);
+    }
+}
+
+// function to write a constant as a C expression of type Value
+static void writeConstant(FILE* out, Chunk* chunk, uint32_t index) {
+    Value value = chunk->constants.values[index];
+    if (IS_NUMBER(value)) {
+        writeNumber(out, AS_NUMBER(value));
+    } else {
+        fprintf(out, "strings[%" PRIu32 "]", index);
+    }
+}
+
+// function to write the name of a global as a C string literal
+static void writeGlobalName(FILE* out, uint32_t slot) {
+    ObjString* name = AS_STRING(vm.globalNames.values[slot]);
+    fputc('"', out);
+    writeCString(out, name->chars, name->length);
+    fputc('"', out);
+}
+
+// function to read a big-endian operand of the given width
+static uint32_t readOperand(uint8_t* bytes, int width) {
+    uint32_t operand = 0;
+    for (int i = 0; i < width; i++) operand = (operand << 8) | bytes[i];
+    return operand;
+}
+
+/**
+ * function to decode the instruction at offset
+ *
+ * Returns its length, and stores its operand and, for jumps, the offset
+ * it lands on (-1 otherwise).
+ */
+static int decode(Chunk* chunk, int offset, uint32_t* operand, int* target) {
+    uint8_t* code = &chunk->code[offset];
+    *operand = 0;
+    *target = -1;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_POPN:
+            *operand = code[1];
+            return 2;
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            *operand = readOperand(&code[1], 3);
+            return 4;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            *target = offset + 3 + (int)readOperand(&code[1], 2);
+            return 3;
+        case OP_LOOP:
+        case OP_POP_LOOP_IF_TRUE:
+        case OP_POP_LOOP_IF_FALSE:
+            *target = offset + 3 - (int)readOperand(&code[1], 2);
+            return 3;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_TRUE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+            *target = offset + 4 + (int)readOperand(&code[1], 3);
+            return 4;
+        case OP_LOOP_LONG:
+        case OP_POP_LOOP_IF_TRUE_LONG:
+        case OP_POP_LOOP_IF_FALSE_LONG:
+            *target = offset + 4 - (int)readOperand(&code[1], 3);
+            return 4;
+        case OP_FORPREP:
+            *target = offset + 7 + (int)readOperand(&code[5], 2);
+            return 7;
+        case OP_FORLOOP:
+            *target = offset + 7 - (int)readOperand(&code[5], 2);
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+// function to write the C comparison OP_FORPREP and OP_FORLOOP test
+static void writeForCompare(FILE* out, uint8_t flags, const char* counter,
+                            const char* limit) {
+    switch (flags & FOR_COMPARE_MASK) {
+        case FOR_LESS:
+            fprintf(out, "%s < %s", counter, limit);
+            break;
+        case FOR_LESS_EQUAL:
+            fprintf(out, "!(%s > %s)", counter, limit);
+            break;
+        case FOR_GREATER:
+            fprintf(out, "%s > %s", counter, limit);
+            break;
+        default:
+            fprintf(out, "!(%s < %s)", counter, limit);
+            break;
+    }
+}
+
+// function to write the limit of OP_FORPREP or OP_FORLOOP
+static void writeForLimit(FILE* out, Chunk* chunk, uint8_t* operands) {
+    fputs("    Value limit = ", out);
+    if (operands[1] & FOR_LIMIT_LOCAL) {
+        fprintf(out, "stack[%d];\n", operands[2]);
+    } else {
+        writeConstant(out, chunk, operands[2]);
+        fputs(";\n", out);
+    }
+}
+
+// function to write OP_FORPREP or OP_FORLOOP as a block of C
+static void writeFor(FILE* out, Chunk* chunk, int offset, int target,
+                     int line) {
+    // The limit test is blamed on the condition, as the interpreter does.
+    int testLine = getLine(chunk, offset + 6);
+    uint8_t opcode = chunk->code[offset];
+    uint8_t* operands = &chunk->code[offset + 1];
+    uint8_t slot = operands[0];
+    uint8_t flags = operands[1];
+
+    fputs("  {\n", out);
+    if (opcode == OP_FORPREP) {
+        fprintf(out, "    Value counter = stack[%d];\n", slot);
+        writeForLimit(out, chunk, operands);
+        fprintf(out, "    if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) "
+                     "return fail(%d, \"Operands must be numbers.\");\n",
+                testLine);
+        fputs("    if (!(", out);
+        writeForCompare(out, flags, "AS_NUMBER(counter)", "AS_NUMBER(limit)");
+        fprintf(out, ")) goto L%d;\n", target);
+    } else {
+        fprintf(out, "    if (!IS_NUMBER(stack[%d])) return fail(%d, \"%s\");\n",
+                slot, line,
+                flags & FOR_STEP_SUBTRACT
+                    ? "Operands must be numbers."
+                    : "Operands must be two numbers or two strings.");
+        fprintf(out, "    double next = AS_NUMBER(stack[%d]) %c "
+                     "AS_NUMBER(", slot,
+                flags & FOR_STEP_SUBTRACT ? '-' : '+');
+        writeConstant(out, chunk, operands[3]);
+        fputs(");\n", out);
+        fprintf(out, "    stack[%d] = NUMBER_VAL(next);\n", slot);
+        writeForLimit(out, chunk, operands);
+        fprintf(out, "    if (!IS_NUMBER(limit)) "
+                     "return fail(%d, \"Operands must be numbers.\");\n",
+                testLine);
+        fputs("    if (", out);
+        writeForCompare(out, flags, "next", "AS_NUMBER(limit)");
+        fprintf(out, ") goto L%d;\n", target);
+    }
+    fputs("  }\n", out);
+}
+
+/**
+ * function to write one instruction as straight-line C
+ *
+ * sp is the VM stack top and stack its base, both kept in locals. sp is
+ * stored back to vm.stackTop before anything that allocates.
+ */
+static void writeInstruction(FILE* out, Chunk* chunk, int offset,
+                             uint32_t operand, int target) {
+    int line = getLine(chunk, offset);
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            fputs("  *sp++ = ", out);
+            writeConstant(out, chunk, operand);
+            fputs(";\n", out);
+            break;
+        case OP_NIL:   fputs("  *sp++ = NIL_VAL;\n", out); break;
+        case OP_TRUE:  fputs("  *sp++ = BOOL_VAL(true);\n", out); break;
+        case OP_FALSE: fputs("  *sp++ = BOOL_VAL(false);\n", out); break;
+        case OP_POP:   fputs("  sp--;\n", out); break;
+        case OP_POPN:  fprintf(out, "  sp -= %" PRIu32 ";\n", operand); break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            fprintf(out, "  *sp++ = stack[%" PRIu32 "];\n", operand);
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            fprintf(out, "  stack[%" PRIu32 "] = sp[-1];\n", operand);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            fprintf(out, "  GLOBAL(%d, %" PRIu32 ", ", line, operand);
+            writeGlobalName(out, operand);
+            fprintf(out, ");\n  *sp++ = globals[%" PRIu32 "];\n", operand);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            fprintf(out, "  globals[%" PRIu32 "] = *--sp;\n", operand);
+            fprintf(out, "  writeBarrier(globals[%" PRIu32 "]);\n", operand);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            fprintf(out, "  GLOBAL(%d, %" PRIu32 ", ", line, operand);
+            writeGlobalName(out, operand);
+            fprintf(out, ");\n  globals[%" PRIu32 "] = sp[-1];\n", operand);
+            fputs("  writeBarrier(sp[-1]);\n", out);
+            break;
+        case OP_EQUAL:
+            fputs("  sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1])); sp--;\n",
+                  out);
+            break;
+        case OP_NOT_EQUAL:
+            fputs("  sp[-2] = BOOL_VAL(!valuesEqual(sp[-2], sp[-1])); sp--;\n",
+                  out);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            fprintf(out, "  BINARY(%d, BOOL_VAL, >);\n", line);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            fprintf(out, "  BINARY(%d, BOOL_VAL, <);\n", line);
+            break;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM:
+            fprintf(out, "  BINARY(%d, NOT_BOOL_VAL, <);\n", line);
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM:
+            fprintf(out, "  BINARY(%d, NOT_BOOL_VAL, >);\n", line);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            fputs("  if (IS_STRING(sp[-1]) && IS_STRING(sp[-2])) {\n"
+                  "    vm.stackTop = sp;\n"
+                  "    concatenate(sp);\n"
+                  "    sp--;\n"
+                  "  } else if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {\n"
+                  "    sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) + "
+                  "AS_NUMBER(sp[-1]));\n"
+                  "    sp--;\n"
+                  "  } else {\n", out);
+            fprintf(out, "    return fail(%d, \"Operands must be two numbers "
+                         "or two strings.\");\n  }\n", line);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            fprintf(out, "  BINARY(%d, NUMBER_VAL, -);\n", line);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            fprintf(out, "  BINARY(%d, NUMBER_VAL, *);\n", line);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            fprintf(out, "  BINARY(%d, NUMBER_VAL, /);\n", line);
+            break;
+        case OP_NOT:
+            fputs("  sp[-1] = BOOL_VAL(isFalsey(sp[-1]));\n", out);
+            break;
+        case OP_NEGATE:
+        case OP_NEGATE_NUM:
+            fprintf(out, "  if (!IS_NUMBER(sp[-1])) "
+                         "return fail(%d, \"Operand must be a number.\");\n",
+                    line);
+            fputs("  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n", out);
+            break;
+        case OP_GREATER_NN:
+            fputs("  BINARY_NN(BOOL_VAL, >);\n", out);
+            break;
+        case OP_LESS_NN:
+            fputs("  BINARY_NN(BOOL_VAL, <);\n", out);
+            break;
+        case OP_GREATER_EQUAL_NN:
+            fputs("  BINARY_NN(NOT_BOOL_VAL, <);\n", out);
+            break;
+        case OP_LESS_EQUAL_NN:
+            fputs("  BINARY_NN(NOT_BOOL_VAL, >);\n", out);
+            break;
+        case OP_ADD_NN:
+            fputs("  BINARY_NN(NUMBER_VAL, +);\n", out);
+            break;
+        case OP_SUBTRACT_NN:
+            fputs("  BINARY_NN(NUMBER_VAL, -);\n", out);
+            break;
+        case OP_MULTIPLY_NN:
+            fputs("  BINARY_NN(NUMBER_VAL, *);\n", out);
+            break;
+        case OP_DIVIDE_NN:
+            fputs("  BINARY_NN(NUMBER_VAL, /);\n", out);
+            break;
+        case OP_NEGATE_NN:
+            fputs("  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n", out);
+            break;
+        case OP_PRINT:
+            fputs("  printValue(*--sp);\n  printf(\"\\n\");\n", out);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            fprintf(out, "  goto L%d;\n", target);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            fprintf(out, "  if (isFalsey(sp[-1])) goto L%d;\n", target);
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_TRUE_LONG:
+            fprintf(out, "  if (!isFalsey(sp[-1])) goto L%d;\n", target);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_LOOP_IF_FALSE:
+        case OP_POP_LOOP_IF_FALSE_LONG:
+            fprintf(out, "  if (isFalsey(*--sp)) goto L%d;\n", target);
+            break;
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+        case OP_POP_LOOP_IF_TRUE:
+        case OP_POP_LOOP_IF_TRUE_LONG:
+            fprintf(out, "  if (!isFalsey(*--sp)) goto L%d;\n", target);
+            break;
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            writeFor(out, chunk, offset, target, line);
+            break;
+        case OP_RETURN:
+            fputs("  vm.stackTop = sp;\n  return 0;\n", out);
+            break;
+    }
+}
+
+/**
+ * function to write a compiled chunk as a standalone C program
+ *
+ * Every instruction becomes a few lines of C over the runtime in value.c,
+ * object.c, memory.c, table.c and vm.c, and every jump a goto. Globals are
+ * registered in slot order and string constants interned before the
+ * script runs, so the slot and constant indexes in the chunk stay valid.
+ */
+void generateC(Chunk* chunk, const char* scriptName, FILE* out) {
+    fputs("// Generated by fcc --emit-c from \"", out);
+    writeCString(out, scriptName, (int)strlen(scriptName));
+    fputs("\".\n", out);
+    fputs(preamble, out);
+
+    int constantCount = chunk->constants.count;
+    fprintf(out, "static Value strings[%d];\n\n", constantCount + 1);
+
+    bool* isTarget = ALLOCATE(bool, chunk->count + 1);
+    memset(isTarget, 0, sizeof(bool) * (chunk->count + 1));
+    for (int offset = 0; offset < chunk->count;) {
+        uint32_t operand;
+        int target;
+        offset += decode(chunk, offset, &operand, &target);
+        if (target != -1) isTarget[target] = true;
+    }
+
+    fputs("static int script(void) {\n"
+          "  Value* stack = vm.stack;\n"
+          "  Value* sp = vm.stackTop;\n"
+          "  Value* globals = vm.globalValues.values;\n", out);
+    for (int offset = 0; offset < chunk->count;) {
+        uint32_t operand;
+        int target;
+        int length = decode(chunk, offset, &operand, &target);
+        if (isTarget[offset]) fprintf(out, "L%d:\n", offset);
+        writeInstruction(out, chunk, offset, operand, target);
+        offset += length;
+    }
+    fputs("}\n\n", out);
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+
+    // The strings are interned into a chunk that vm.chunk points to, which
+    // makes them roots for the collector the way the VM's constants are.
+    // collectYoung() then promotes them, so they never move again and
+    // strings[] can hold them for good.
+    fputs("int main(void) {\n  initVM();\n", out);
+    fprintf(out, "  reserveStack(%d + STACK_GC_SLOTS);\n", chunk->maxStack);
+    fputs("  Chunk chunk;\n"
+          "  initChunk(&chunk);\n"
+          "  vm.chunk = &chunk;\n", out);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        ObjString* name = AS_STRING(vm.globalNames.values[i]);
+        fputs("  globalSlot(copyString(\"", out);
+        writeCString(out, name->chars, name->length);
+        fprintf(out, "\", %d));\n", name->length);
+    }
+    for (int i = 0; i < constantCount; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_STRING(value)) continue;
+        ObjString* string = AS_STRING(value);
+        fputs("  addConstant(&chunk, OBJ_VAL(copyString(\"", out);
+        writeCString(out, string->chars, string->length);
+        fprintf(out, "\", %d)));\n", string->length);
+    }
+    fputs("  collectYoung();\n", out);
+    // The pool has no duplicates, so its strings come back in order.
+    int stringCount = 0;
+    for (int i = 0; i < constantCount; i++) {
+        if (!IS_STRING(chunk->constants.values[i])) continue;
+        fprintf(out, "  strings[%d] = chunk.constants.values[%d];\n",
+                i, stringCount++);
+    }
+    fputs("  int status = script();\n"
+          "  freeChunk(&chunk);\n"
+          "  freeVM();\n"
+          "  return status;\n"
+          "}\n", out);
+}
@@ -0,0 +1,11 @@
+#ifndef fcc_cgen_h
+#define fcc_cgen_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+// function declaration for the C backend
+void generateC(Chunk* chunk, const char* scriptName, FILE* out);
+
+#endif
@@ -1,8 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
+#define CONSTANT_SLOTS_MAX_LOAD 0.75
 
 /**
  * function to initialize empty chunk
@@ -14,7 +17,33 @@ void initChunk(Chunk* chunk){
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     initValueArray(&chunk->constants);
+    chunk->constantSlots = NULL;
+    chunk->constantSlotCapacity = 0;
+    chunk->maxStack = 0;
+}
+
+/**
+ * function to record that the code from offset on comes from line
+ *
+ * Offsets must not decrease. A line equal to the last run's extends it.
+ */
+void addLine(Chunk* chunk, int offset, int line){
+    if(chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line){
+        return;
+    }
+
+    if(chunk->lineCapacity < chunk->lineCount + 1){
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset = offset;
+    start->line = line;
 }
 
 /**
@@ -28,14 +57,42 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
+    addLine(chunk, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+/**
+ * function to drop the code from count on, and the lines only it used
+ */
+void truncateChunk(Chunk* chunk, int count){
+    chunk->count = count;
+    while(chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count){
+        chunk->lineCount--;
+    }
+}
+
+/**
+ * function to get the source line of the byte at offset
+ *
+ * Binary search for the last run starting at or before offset.
+ */
+int getLine(Chunk* chunk, int offset){
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while(low < high){
+        int middle = low + (high - low + 1) / 2;
+        if(chunk->lines[middle].offset <= offset){
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
 /**
  * function to free byte_code array in chunk
  * 
@@ -43,16 +100,150 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
  */
 void freeChunk(Chunk* chunk){
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
     initChunk(chunk);
+    if (vm.chunk == chunk) vm.chunk = NULL;
+}
+
+// function to get the raw bits a constant is deduplicated on
+static uint64_t constantBits(Value value) {
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL:   bits = AS_BOOL(value); break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+        default:         break;
+    }
+    return bits ^ ((uint64_t)value.type << 61);
+#endif
+}
+
+// function to check whether two constants are the same value, bit for bit
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    // The bits of different types can coincide, so the types must match too.
+    return a.type == b.type && constantBits(a) == constantBits(b);
+#endif
+}
+
+// function to hash constant bits (64-bit finalizer from MurmurHash3)
+static uint32_t hashConstant(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/**
+ * function to find the bucket of a constant in the slot index
+ *
+ * Constants are matched by type and bit pattern, not valuesEqual(): 0 and
+ * -0 must stay distinct, and strings are interned so their pointers
+ * identify them.
+ */
+static int* findConstantSlot(Chunk* chunk, Value value) {
+    uint32_t mask = (uint32_t)chunk->constantSlotCapacity - 1;
+    uint32_t index = hashConstant(constantBits(value)) & mask;
+    for (;;) {
+        int* bucket = &chunk->constantSlots[index];
+        if (*bucket == 0 ||
+            sameConstant(chunk->constants.values[*bucket - 1], value)) {
+            return bucket;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+/**
+ * function to rebuild the slot index in place
+ *
+ * Also called by the collector after it moved strings in the pool, since
+ * their addresses are what the index is keyed on.
+ */
+void rehashConstants(Chunk* chunk) {
+    int capacity = chunk->constantSlotCapacity;
+    for (int i = 0; i < capacity; i++) chunk->constantSlots[i] = 0;
+    if (capacity == 0) return;
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        *findConstantSlot(chunk, value) = i + 1;
+    }
+}
+
+// function to rebuild the slot index with a new capacity
+static void adjustConstantSlots(Chunk* chunk, int capacity) {
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = ALLOCATE(int, capacity);
+    chunk->constantSlotCapacity = capacity;
+    rehashConstants(chunk);
 }
 
 /**
  * function to add constant
+ *
+ * Returns the slot of an identical constant if the chunk already has one.
  */
 int addConstant(Chunk* chunk, Value value) {
+  // value may be a string nothing refers to yet; growing can collect.
+  push(value);
+  if (chunk->constants.count + 1 >
+      chunk->constantSlotCapacity * CONSTANT_SLOTS_MAX_LOAD) {
+    adjustConstantSlots(chunk, GROW_CAPACITY(chunk->constantSlotCapacity));
+  }
+
+  int* bucket = findConstantSlot(chunk, value);
+  if (*bucket > 0) {
+    pop();
+    return *bucket - 1;
+  }
+
   writeValueArray(&chunk->constants, value);
+  writeBarrier(value);
+  *bucket = chunk->constants.count;
+  pop();
   return chunk->constants.count - 1;
 }
 
+/**
+ * function to remove the most recently added constant
+ *
+ * Used by the compiler when it folds away the only load of a constant.
+ * The bucket is emptied and the rest of its probe run is shifted back so
+ * that the index never needs tombstones.
+ */
+void removeLastConstant(Chunk* chunk) {
+  Value value = chunk->constants.values[chunk->constants.count - 1];
+  int* slots = chunk->constantSlots;
+  uint32_t mask = (uint32_t)chunk->constantSlotCapacity - 1;
+  uint32_t hole = (uint32_t)(findConstantSlot(chunk, value) - slots);
+  chunk->constants.count--;
+  slots[hole] = 0;
+
+  uint32_t index = hole;
+  for (;;) {
+    index = (index + 1) & mask;
+    if (slots[index] == 0) return;
+
+    Value moved = chunk->constants.values[slots[index] - 1];
+    uint32_t home = hashConstant(constantBits(moved)) & mask;
+    // Leave the entry where it is if its home lies cyclically in (hole, index].
+    bool reachable = hole <= index ? (hole < home && home <= index)
+                                   : (hole < home || home <= index);
+    if (reachable) continue;
+
+    slots[hole] = slots[index];
+    slots[index] = 0;
+    hole = index;
+  }
+}
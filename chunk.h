@@ -6,6 +6,9 @@
 
 /**
  * Enum for operation code
+ *
+ * Bytecode cache files store these numbers: bump CACHE_VERSION in cache.h
+ * when adding, removing or reordering opcodes.
  */
 typedef enum{
     OP_CONSTANT,
@@ -30,10 +33,88 @@ typedef enum{
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    OP_POP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_POP_LOOP_IF_TRUE,
+    OP_FORPREP,
+    OP_FORLOOP,
     OP_RETURN,
+    // Wide forms with a three byte operand. The compiler only emits these
+    // when the operand does not fit the one or two bytes of the short form.
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_IF_TRUE_LONG,
+    OP_POP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
+    OP_POP_LOOP_IF_TRUE_LONG,
+    OP_POP_JUMP_IF_TRUE_LONG,
+    OP_POP_LOOP_IF_FALSE_LONG,
+    // Fused forms. Only optimizeChunk() emits these.
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_POPN,
+    OP_POP_JUMP_IF_TRUE,
+    OP_POP_LOOP_IF_FALSE,
+    // Quickened forms. The compiler never emits these; run() rewrites a
+    // generic instruction into one after seeing number operands.
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_NUM,
+    // Unchecked forms. The compiler emits these when it can prove every
+    // operand is a number, so they skip the type checks altogether.
+    OP_GREATER_NN,
+    OP_LESS_NN,
+    OP_GREATER_EQUAL_NN,
+    OP_LESS_EQUAL_NN,
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_NEGATE_NN,
 } OpCode;
 
+/**
+ * Enum for the flags operand of OP_FORPREP and OP_FORLOOP
+ *
+ * The low two bits hold the comparison between the counter and the limit.
+ * FOR_LIMIT_LOCAL means the limit operand is a local slot instead of a
+ * constant index, and FOR_STEP_SUBTRACT that the step is subtracted.
+ */
+typedef enum {
+    FOR_LESS,
+    FOR_LESS_EQUAL,
+    FOR_GREATER,
+    FOR_GREATER_EQUAL,
+    FOR_COMPARE_MASK = 3,
+    FOR_LIMIT_LOCAL = 4,
+    FOR_STEP_SUBTRACT = 8,
+} ForFlags;
+
+/**
+ * Structure of one run of the line table
+ *
+ * offset "first byte of code from this line"
+ * line "source line of the code up to the next run's offset"
+ */
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 /**
  * Structure to hold the instruction chunk
  * 
@@ -41,21 +122,36 @@ typedef enum{
  * count "how many allocated elements are in use"
  * constants "chunk constants"
  * code "byte_code array",
- * lines "line of source file"
+ * lines "line table, one run per change of source line, sorted by offset"
+ * lineCount "number of runs in lines"
+ * lineCapacity "number of runs allocated"
+ * constantSlots "open addressing index from constant value to pool slot,
+ *                holding slot + 1 and 0 for an empty bucket"
+ * constantSlotCapacity "number of buckets in constantSlots"
+ * maxStack "most values the code ever has on the VM stack at once"
  */
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    LineStart* lines;
+    int lineCount;
+    int lineCapacity;
     ValueArray constants;
-    
+    int* constantSlots;
+    int constantSlotCapacity;
+    int maxStack;
 } Chunk;
 
 // function declarations for chunk functions
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void addLine(Chunk* chunk, int offset, int line);
+void truncateChunk(Chunk* chunk, int count);
+int getLine(Chunk* chunk, int offset);
 int addConstant(Chunk* chunk, Value value);
+void removeLastConstant(Chunk* chunk);
+void rehashConstants(Chunk* chunk);
 
 #endif
@@ -5,9 +5,65 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Represent Value as a single NaN-boxed 64-bit word instead of a tagged
+// struct. Build with -DNO_NAN_BOXING to get the struct representation back.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// Build with -DDEBUG_STRESS_GC to collect the nursery on every new object
+// and step the major collector on every allocation, rather than when the
+// heap has grown, to shake out objects left unrooted or unbarriered.
+
+// Run the peephole optimizer over every compiled chunk. Build with
+// -DNO_PEEPHOLE to execute the compiler's output unchanged.
+#ifndef NO_PEEPHOLE
+#define PEEPHOLE
+#endif
+
+// Threaded dispatch in run() needs the labels-as-values GNU extension.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Scan whitespace, comments, identifiers, numbers and strings a block of
+// 16 bytes at a time with SSE2, or 32 when the compiler targets AVX2.
+// Build with -DNO_SIMD_SCANNER to scan one byte at a time.
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(NO_SIMD_SCANNER)
+#define SIMD_SCANNER
+#endif
+
+// Compile hot loops to x86-64 machine code when run with --jit. The
+// generated code relies on the NaN-boxed Value layout and the System V
+// calling convention. Build with -DNO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// Keep compiled scripts in bytecode cache files next to them and map them
+// back in on later runs. Needs POSIX mmap. Build with -DNO_BYTECODE_CACHE
+// to always compile from source.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_BYTECODE_CACHE)
+#define BYTECODE_CACHE
+#endif
+
+// Serve small blocks from reallocate() out of size-class pools carved from
+// large slabs instead of one malloc() each. Build with -DNO_POOL_ALLOC to
+// go straight to malloc(), e.g. so a sanitizer sees every block.
+#ifndef NO_POOL_ALLOC
+#define POOL_ALLOC
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// Largest operand of the three byte *_LONG instruction forms.
+#define UINT24_MAX 0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
 
 #endif
\ No newline at end of file
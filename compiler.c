@@ -4,6 +4,8 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -39,15 +41,197 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
+/**
+ * Enum for what the compiler can prove about a value at runtime
+ */
+typedef enum {
+  TYPE_UNKNOWN,
+  TYPE_NUMBER,
+  TYPE_BOOL,
+} StaticType;
+
+/**
+ * Structure of a local variable
+ *
+ * type "type of every value the local can hold; each assignment is checked
+ *       against it"
+ * declaration "how many locals were declared before it in the script, which
+ *              names it across compile passes"
+ */
 typedef struct {
   Token name;
   int depth;
+  StaticType type;
+  int declaration;
 } Local;
 
+/**
+ * Structure of a name declared with const
+ *
+ * name "the constant's name"
+ * depth "scope depth it was declared at"
+ * value "its value, loaded in place of every reference"
+ * localCount "number of locals in scope at the declaration; locals from
+ *             that index on shadow it"
+ */
+typedef struct {
+  Token name;
+  int depth;
+  Value value;
+  int localCount;
+} NamedConstant;
+
+/**
+ * Structure of the locals whose static type was contradicted by a later
+ * assignment, kept across compile passes
+ *
+ * untyped "flag per declaration number; those locals get TYPE_UNKNOWN"
+ * capacity "number of flags allocated"
+ * conflictPasses "passes that found a conflict; after two, every local
+ *                 gets TYPE_UNKNOWN"
+ */
+typedef struct {
+  bool* untyped;
+  int capacity;
+  int conflictPasses;
+} LocalTypes;
+
+/**
+ * Structure of a global variable read or assignment inside a loop
+ *
+ * name "the token naming the global"
+ * slot "slot of the global in vm.globalValues"
+ * assigned "an assignment rather than a read"
+ */
+typedef struct {
+  Token name;
+  int slot;
+  bool assigned;
+} GlobalAccess;
+
+/**
+ * Enum for the bits kept per global slot while finding loop-invariant reads
+ */
+typedef enum {
+  GLOBAL_DEFINED = 1,   // a top-level var defined it before this point
+  GLOBAL_ASSIGNED = 2,  // the loop being analysed assigns it
+  GLOBAL_HOISTED = 4,   // the loop being analysed already hoists it
+} GlobalFlag;
+
+/**
+ * Structure of a global that a loop loads once into a hidden local
+ *
+ * loop "number of the loop, counting loops in the order they start"
+ * name "the token naming the global, which the hidden local is named after"
+ */
+typedef struct {
+  int loop;
+  Token name;
+} Hoist;
+
+/**
+ * Structure of the globals every loop hoists, kept across compile passes
+ *
+ * known "an earlier pass found them; hoists is sorted by loop"
+ * hoists "the hoisted globals"
+ * count "number of hoisted globals"
+ * capacity "number of hoists allocated"
+ */
+typedef struct {
+  bool known;
+  Hoist* hoists;
+  int count;
+  int capacity;
+} LoopHoists;
+
+/**
+ * Structure of a loop being compiled
+ *
+ * number "number of the loop, counting loops in the order they start"
+ * firstAccess "index of the first global access logged inside the loop"
+ */
+typedef struct {
+  int number;
+  int firstAccess;
+} Loop;
+
+/**
+ * Structure to remember the most recent instruction that pushed a constant
+ *
+ * start "offset of the instruction"
+ * end "offset just past the instruction, -1 if there is none"
+ * constant "constant pool index, -1 for OP_NIL/OP_TRUE/OP_FALSE"
+ * fresh "the pool slot was appended for this load and nothing else uses it"
+ * value "the value pushed"
+ */
+typedef struct {
+  int start;
+  int end;
+  int constant;
+  bool fresh;
+  Value value;
+} ConstantLoad;
+
+/**
+ * Structure holding code cut out of the chunk to be emitted again later
+ *
+ * code "the cut bytecode"
+ * lines "line of each cut byte"
+ * count "number of cut bytes"
+ */
+typedef struct {
+  uint8_t* code;
+  int* lines;
+  int count;
+} Fragment;
+
+/**
+ * Structure of the compiler
+ *
+ * lastConstant "last constant load, used for constant folding"
+ * lastType "static type of the value pushed by the code ending at lastTypeEnd"
+ * lastTypeEnd "end offset of the last instruction with a known result type"
+ * lastJumpTarget "highest offset a forward jump has been patched to"
+ * longJumps "emit forward jumps in their *_LONG form"
+ * jumpOverflow "a short forward jump could not reach its target"
+ * declarationCount "number of locals declared so far"
+ * localTypes "locals to leave untyped, from earlier passes"
+ * typeConflict "an assignment contradicted a local's type in this pass"
+ * loopCount "number of loops started so far"
+ * loopDepth "number of loops being compiled"
+ * accesses "global reads and assignments inside loops, logged while
+ *           loopHoists is not known yet"
+ * globalFlags "GlobalFlag bits per global slot"
+ * loopHoists "globals each loop hoists"
+ * nextHoist "index in loopHoists of the next loop's first hoist"
+ * namedConstants "consts in scope, innermost last"
+ */
 typedef struct {
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   int scopeDepth;
+  ConstantLoad lastConstant;
+  StaticType lastType;
+  int lastTypeEnd;
+  int lastJumpTarget;
+  bool longJumps;
+  bool jumpOverflow;
+  int declarationCount;
+  LocalTypes* localTypes;
+  bool typeConflict;
+  int loopCount;
+  int loopDepth;
+  GlobalAccess* accesses;
+  int accessCount;
+  int accessCapacity;
+  uint8_t* globalFlags;
+  int globalFlagCapacity;
+  LoopHoists* loopHoists;
+  int nextHoist;
+  NamedConstant* namedConstants;
+  int namedConstantCount;
+  int namedConstantCapacity;
 } Compiler;
 
 Parser parser;
@@ -132,24 +316,76 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
-// function to emit loop 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+// function to emit a three byte operand
+static void emitLong(int operand) {
+  emitByte((operand >> 16) & 0xff);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+/**
+ * function to emit an instruction with a one byte operand
+ *
+ * Falls back to the *_LONG form with a three byte operand when the operand
+ * does not fit, so the common case stays as short as before.
+ */
+static void emitOperand(uint8_t instruction, uint8_t longInstruction,
+                        int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)operand);
+  } else {
+    emitByte(longInstruction);
+    emitLong(operand);
+  }
+}
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+/**
+ * function to emit loop
+ *
+ * instruction is OP_LOOP, or OP_POP_LOOP_IF_TRUE for the condition at the
+ * bottom of an inverted loop.
+ */
+static void emitLoop(uint8_t instruction, int loopStart) {
+  // +3 to jump back over the loop instruction itself.
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset <= UINT16_MAX) {
+    emitByte(instruction);
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    return;
+  }
+
+  offset++;
+  if (offset > UINT24_MAX) error("Loop body too large.");
+  emitByte(instruction == OP_LOOP ? OP_LOOP_LONG : OP_POP_LOOP_IF_TRUE_LONG);
+  emitLong(offset);
 }
 
 
-// function to emit jump
+/**
+ * function to emit jump
+ *
+ * The distance of a forward jump is unknown until patchJump(), so the
+ * width is picked per compile: short jumps first, and every jump long if
+ * compile() has to start over because one of them overflowed.
+ */
 static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+  if (!current->longJumps) {
+    emitByte(instruction);
+    emitByte(0xff);
+    emitByte(0xff);
+    return currentChunk()->count - 2;
+  }
+
+  switch (instruction) {
+    case OP_JUMP:              emitByte(OP_JUMP_LONG); break;
+    case OP_JUMP_IF_FALSE:     emitByte(OP_JUMP_IF_FALSE_LONG); break;
+    case OP_JUMP_IF_TRUE:      emitByte(OP_JUMP_IF_TRUE_LONG); break;
+    case OP_POP_JUMP_IF_FALSE: emitByte(OP_POP_JUMP_IF_FALSE_LONG); break;
+    default: return -1; // Unreachable.
+  }
+  emitLong(UINT24_MAX);
+  return currentChunk()->count - 3;
 }
 
 // function to emit return
@@ -158,45 +394,334 @@ static void emitReturn() {
 }
 
 // function to make constant
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > UINT24_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+// function to record the static type of the value the code just emitted pushes
+static void markType(StaticType type) {
+  current->lastType = type;
+  current->lastTypeEnd = currentChunk()->count;
+}
+
+// function to record that the instruction just emitted pushes a number
+static void markNumber() {
+  markType(TYPE_NUMBER);
 }
 
 // function to emit constant
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  ConstantLoad* load = &current->lastConstant;
+  load->start = currentChunk()->count;
+  load->value = value;
+  load->fresh = false;
+
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+    load->constant = -1;
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    load->constant = -1;
+  } else {
+    int count = currentChunk()->constants.count;
+    load->constant = makeConstant(value);
+    emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, load->constant);
+    load->fresh = currentChunk()->constants.count > count;
+  }
+
+  load->end = currentChunk()->count;
+  markType(IS_NUMBER(value) ? TYPE_NUMBER
+           : IS_BOOL(value) ? TYPE_BOOL
+                            : TYPE_UNKNOWN);
 }
 
-static void initCompiler(Compiler* compiler) {
+/**
+ * function to read a constant load's value back from the pool
+ *
+ * A string may have been moved by collectYoung() since it was loaded, and
+ * only the copy in the pool is kept up to date.
+ */
+static void refreshConstantLoad(ConstantLoad* load) {
+  if (load->constant != -1) {
+    load->value = currentChunk()->constants.values[load->constant];
+  }
+}
+
+/**
+ * function to check whether the code just emitted is a lone constant load
+ *
+ * No jump may land inside or right after it, otherwise the value on the
+ * stack at this point might come from somewhere else.
+ */
+static bool lastConstantLoad(ConstantLoad* load) {
+  *load = current->lastConstant;
+  if (load->end == -1 || load->end != currentChunk()->count ||
+      current->lastJumpTarget > load->start) {
+    return false;
+  }
+  refreshConstantLoad(load);
+  return true;
+}
+
+/**
+ * function to get the static type of the value the code just emitted pushes
+ *
+ * A jump landing at the end means the value may come from another path.
+ */
+static StaticType lastType() {
+  if (current->lastTypeEnd != currentChunk()->count ||
+      current->lastJumpTarget >= currentChunk()->count) {
+    return TYPE_UNKNOWN;
+  }
+  return current->lastType;
+}
+
+// function to check whether the code just emitted always pushes a number
+static bool lastIsNumber() {
+  return lastType() == TYPE_NUMBER;
+}
+
+// function to drop a folded constant load from the chunk
+static void discardConstantLoad(ConstantLoad* load) {
+  Chunk* chunk = currentChunk();
+  if (load->fresh && load->constant == chunk->constants.count - 1) {
+    removeLastConstant(chunk);
+  }
+  truncateChunk(chunk, load->start);
+  current->lastConstant.end = -1;
+}
+
+static void initCompiler(Compiler* compiler, bool longJumps,
+                         LocalTypes* localTypes, LoopHoists* loopHoists) {
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->lastConstant.end = -1;
+  compiler->lastTypeEnd = -1;
+  compiler->lastJumpTarget = 0;
+  compiler->longJumps = longJumps;
+  compiler->jumpOverflow = false;
+  compiler->declarationCount = 0;
+  compiler->localTypes = localTypes;
+  compiler->typeConflict = false;
+  compiler->loopCount = 0;
+  compiler->loopDepth = 0;
+  compiler->accesses = NULL;
+  compiler->accessCount = 0;
+  compiler->accessCapacity = 0;
+  compiler->globalFlags = NULL;
+  compiler->globalFlagCapacity = 0;
+  compiler->loopHoists = loopHoists;
+  compiler->nextHoist = 0;
+  compiler->namedConstants = NULL;
+  compiler->namedConstantCount = 0;
+  compiler->namedConstantCapacity = 0;
   current = compiler;
 }
 
 // function to patch jump
 static void patchJump(int offset) {
+  uint8_t* code = currentChunk()->code;
+  current->lastJumpTarget = currentChunk()->count;
+
+  if (current->longJumps) {
+    // -3 to adjust for the bytecode for the jump offset itself.
+    int jump = currentChunk()->count - offset - 3;
+    if (jump > UINT24_MAX) {
+      error("Too much code to jump over.");
+    }
+
+    code[offset] = (jump >> 16) & 0xff;
+    code[offset + 1] = (jump >> 8) & 0xff;
+    code[offset + 2] = jump & 0xff;
+    return;
+  }
+
   // -2 to adjust for the bytecode for the jump offset itself.
   int jump = currentChunk()->count - offset - 2;
 
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    // compile() starts over with long jumps once this pass is done.
+    current->jumpOverflow = true;
+    return;
+  }
+
+  code[offset] = (jump >> 8) & 0xff;
+  code[offset + 1] = jump & 0xff;
+}
+
+/**
+ * function to cut the code emitted since start out of the chunk
+ *
+ * Lets a loop compile its condition and increment where they appear in
+ * the source and emit them again after the body. Jumps inside the cut code
+ * are relative to itself, so they stay valid when it is pasted back.
+ */
+static void cutFragment(int start, Fragment* fragment) {
+  Chunk* chunk = currentChunk();
+  fragment->count = chunk->count - start;
+  fragment->code = ALLOCATE(uint8_t, fragment->count);
+  fragment->lines = ALLOCATE(int, fragment->count);
+  memcpy(fragment->code, chunk->code + start, fragment->count);
+  for (int i = 0; i < fragment->count; i++) {
+    fragment->lines[i] = getLine(chunk, start + i);
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  truncateChunk(chunk, start);
+  current->lastConstant.end = -1;
+  current->lastTypeEnd = -1;
+  if (current->lastJumpTarget > start) current->lastJumpTarget = start;
+}
+
+// function to free a cut fragment
+static void freeFragment(Fragment* fragment) {
+  FREE_ARRAY(uint8_t, fragment->code, fragment->count);
+  FREE_ARRAY(int, fragment->lines, fragment->count);
+}
+
+// function to emit a cut fragment again and free it
+static void pasteFragment(Fragment* fragment) {
+  for (int i = 0; i < fragment->count; i++) {
+    writeChunk(currentChunk(), fragment->code[i], fragment->lines[i]);
+  }
+  current->lastJumpTarget = currentChunk()->count;
+  freeFragment(fragment);
+}
+
+/**
+ * function to get the stack effect of the instruction at code
+ *
+ * Sets *length to the size of the instruction in bytes.
+ */
+static int stackEffect(uint8_t* code, int* length) {
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      *length = 1;
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+      *length = 2;
+      return 1;
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+      *length = 4;
+      return 1;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+      *length = 2;
+      return 0;
+    case OP_SET_LOCAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      *length = 4;
+      return 0;
+    case OP_DEFINE_GLOBAL:
+      *length = 2;
+      return -1;
+    case OP_DEFINE_GLOBAL_LONG:
+      *length = 4;
+      return -1;
+    case OP_POPN:
+      *length = 2;
+      return -code[1];
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+      *length = 3;
+      return 0;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_JUMP_IF_TRUE_LONG:
+    case OP_LOOP_LONG:
+      *length = 4;
+      return 0;
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_POP_LOOP_IF_TRUE:
+    case OP_POP_LOOP_IF_FALSE:
+      *length = 3;
+      return -1;
+    case OP_POP_JUMP_IF_FALSE_LONG:
+    case OP_POP_JUMP_IF_TRUE_LONG:
+    case OP_POP_LOOP_IF_TRUE_LONG:
+    case OP_POP_LOOP_IF_FALSE_LONG:
+      *length = 4;
+      return -1;
+    case OP_FORPREP:
+    case OP_FORLOOP:
+      *length = 7;
+      return 0;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_NEGATE_NN:
+    case OP_RETURN:
+      *length = 1;
+      return 0;
+    default:
+      // OP_POP, OP_PRINT and the binary operators.
+      *length = 1;
+      return -1;
+  }
+}
+
+/**
+ * function to work out the most values the chunk ever has on the stack
+ *
+ * All control flow the compiler emits is structured. Every jump lands
+ * where the stack is as deep as at the jump, and the code after an
+ * unconditional jump starts at the depth before it. So summing stack
+ * effects in code order gives the depth at every instruction.
+ */
+static void computeMaxStack() {
+  Chunk* chunk = currentChunk();
+  int depth = 0;
+  int maxStack = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    int length;
+    depth += stackEffect(&chunk->code[offset], &length);
+    if (depth > maxStack) maxStack = depth;
+    offset += length;
+  }
+  chunk->maxStack = maxStack;
+}
+
+// function to check whether compile() keeps this pass or compiles again
+static bool passIsFinal() {
+  return !current->jumpOverflow && !current->typeConflict &&
+         (current->loopHoists->known || current->loopHoists->count == 0);
 }
 
 // function to end compiler
 static void endCompiler() {
   emitReturn();
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  FREE_ARRAY(GlobalAccess, current->accesses, current->accessCapacity);
+  FREE_ARRAY(uint8_t, current->globalFlags, current->globalFlagCapacity);
+  FREE_ARRAY(NamedConstant, current->namedConstants,
+             current->namedConstantCapacity);
+  current->namedConstants = NULL;
+  current->namedConstantCount = 0;
+  current->namedConstantCapacity = 0;
+#ifdef PEEPHOLE
+  if (!parser.hadError && passIsFinal()) {
+    optimizeChunk(currentChunk());
+  }
+#endif
+  if (!parser.hadError && passIsFinal()) computeMaxStack();
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser.hadError && passIsFinal()) {
     disassembleChunk(currentChunk(), "code");
   }
 #endif
@@ -216,6 +741,12 @@ static void endScope() {
     emitByte(OP_POP);
     current->localCount--;
   }
+
+  while (current->namedConstantCount > 0 &&
+         current->namedConstants[current->namedConstantCount - 1].depth >
+             current->scopeDepth) {
+    current->namedConstantCount--;
+  }
 }
 
 // static function forward declarations
@@ -226,9 +757,15 @@ static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
 
-// function to handle identifier constant
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+// function to resolve a global name to its slot in vm.globalValues
+static int identifierGlobal(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT24_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return slot;
 }
 
 // function to check two identifiers are equal
@@ -252,57 +789,176 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-// function to add local variable
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+// function to add local variable, returns NULL if there is no room
+static Local* addLocal(Token name) {
+  if (current->localCount == UINT24_COUNT) {
     error("Too many local variables in function.");
-    return;
+    return NULL;
+  }
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals,
+                                 oldCapacity, current->localCapacity);
   }
   Local* local = &current->locals[current->localCount++];
   local->name = name;
   local->depth = -1;
+  local->type = TYPE_UNKNOWN;
+  local->declaration = -1;
+  return local;
 }
 
-// function to declare a variable
-static void declareVariable() {
-  if(current->scopeDepth == 0) return;
+/**
+ * function to check whether an earlier pass found the local's type wrong
+ *
+ * Untyping one local can contradict the locals assigned from it, and a
+ * chain of them written in reverse would take a pass per local. So once
+ * two passes have found conflicts, no local is typed at all.
+ */
+static bool isUntyped(Local* local) {
+  LocalTypes* types = current->localTypes;
+  if (types->conflictPasses >= 2) return true;
+  return local->declaration >= 0 && local->declaration < types->capacity &&
+         types->untyped[local->declaration];
+}
 
-  Token* name = &parser.previous;
+/**
+ * function to check an assignment against the static type of a local
+ *
+ * The local's type was already used for code before this point, and a loop
+ * can run that code again after the assignment. So a mismatch marks the
+ * local untyped and compile() runs another pass.
+ */
+static void checkLocalType(Local* local, StaticType type) {
+  if (local->type == TYPE_UNKNOWN || local->type == type) return;
+
+  LocalTypes* types = current->localTypes;
+  if (types->capacity <= local->declaration) {
+    int oldCapacity = types->capacity;
+    types->capacity = GROW_CAPACITY(local->declaration + 1);
+    types->untyped = GROW_ARRAY(bool, types->untyped,
+                                oldCapacity, types->capacity);
+    memset(types->untyped + oldCapacity, 0,
+           sizeof(bool) * (types->capacity - oldCapacity));
+  }
+  types->untyped[local->declaration] = true;
+  local->type = TYPE_UNKNOWN;
+  current->typeConflict = true;
+}
+
+// function to set GlobalFlag bits on a global slot
+static void flagGlobal(int slot, uint8_t flags) {
+  if (current->globalFlagCapacity <= slot) {
+    int oldCapacity = current->globalFlagCapacity;
+    current->globalFlagCapacity = GROW_CAPACITY(slot + 1);
+    current->globalFlags = GROW_ARRAY(uint8_t, current->globalFlags,
+                                      oldCapacity,
+                                      current->globalFlagCapacity);
+    memset(current->globalFlags + oldCapacity, 0,
+           current->globalFlagCapacity - oldCapacity);
+  }
+  current->globalFlags[slot] |= flags;
+}
+
+// function to log a global read or assignment while its loops are unknown
+static void logGlobalAccess(Token name, int slot, bool assigned) {
+  if (current->loopDepth == 0 || current->loopHoists->known) return;
+
+  if (current->accessCapacity < current->accessCount + 1) {
+    int oldCapacity = current->accessCapacity;
+    current->accessCapacity = GROW_CAPACITY(oldCapacity);
+    current->accesses = GROW_ARRAY(GlobalAccess, current->accesses,
+                                   oldCapacity, current->accessCapacity);
+  }
+  GlobalAccess* access = &current->accesses[current->accessCount++];
+  access->name = name;
+  access->slot = slot;
+  access->assigned = assigned;
+  flagGlobal(slot, 0);
+}
+
+// function to check for a local of this name in the innermost scope
+static bool localInScope(Token* name) {
   for (int i = current->localCount - 1; i >= 0; i--) {
     Local* local = &current->locals[i];
     if (local->depth != -1 && local->depth < current->scopeDepth) {
       break; 
     }
 
-    if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+    if (identifiersEqual(name, &local->name)) return true;
+  }
+  return false;
+}
+
+// function to check for a const of this name in the innermost scope
+static bool constantInScope(Token* name) {
+  for (int i = current->namedConstantCount - 1; i >= 0; i--) {
+    NamedConstant* constant = &current->namedConstants[i];
+    if (constant->depth < current->scopeDepth) break;
+    if (identifiersEqual(name, &constant->name)) return true;
+  }
+  return false;
+}
+
+/**
+ * function to resolve a const
+ *
+ * local is what resolveLocal() found for the name. A local declared after
+ * the const shadows it. Returns NULL when the name is not a const.
+ */
+static NamedConstant* resolveConstant(Token* name, int local) {
+  for (int i = current->namedConstantCount - 1; i >= 0; i--) {
+    NamedConstant* constant = &current->namedConstants[i];
+    if (identifiersEqual(name, &constant->name)) {
+      return local >= constant->localCount ? NULL : constant;
     }
   }
-  addLocal(*name);
+  return NULL;
+}
+
+// function to declare a variable
+static void declareVariable() {
+  Token* name = &parser.previous;
+  if (constantInScope(name)) {
+    error("Already a constant with this name in this scope.");
+  }
+  if(current->scopeDepth == 0) return;
+
+  if (localInScope(name)) {
+    error("Already a variable with this name in this scope.");
+  }
+  // Hidden locals are left out of the count, so a local keeps its number
+  // in passes that hoist globals.
+  Local* local = addLocal(*name);
+  if (local != NULL) local->declaration = current->declarationCount++;
 }
 
 // function to parse variable
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if(current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
-// function to mark initialized
+// function to mark initialized, typing the local by its initializer
 static void markInitialized() {
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+  Local* local = &current->locals[current->localCount - 1];
+  local->depth = current->scopeDepth;
+  if (!isUntyped(local)) local->type = lastType();
 }
 
 // function to define a variable
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if(current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+  flagGlobal(global, GLOBAL_DEFINED);
 }
 
 // function to handle and operator
@@ -315,33 +971,156 @@ static void and_(bool canAssign) {
   patchJump(endJump);
 }
 
+// function to check falsiness of a value at compile time
+static bool isFalseyConstant(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// function to concatenate two string constants
+static Value concatenateConstants(ObjString* a, ObjString* b) {
+  // Pushed so the collector can move them while the result is allocated.
+  push(OBJ_VAL(a));
+  push(OBJ_VAL(b));
+  Value result = OBJ_VAL(concatenateStrings());
+  pop();
+  pop();
+  return result;
+}
+
+/**
+ * function to evaluate a binary operator on two constants
+ *
+ * Returns false when the operation would be a runtime error, so the
+ * instructions are still emitted and the error still happens at runtime.
+ */
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+  switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+    case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+    case TOKEN_PLUS:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        *result = concatenateConstants(AS_STRING(a), AS_STRING(b));
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+
+  // The comparisons mirror the instructions the compiler emits, so that
+  // <= stays !(x > y) and NaN compares the same way as at runtime.
+  switch (operatorType) {
+    case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+    case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+    case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+    case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+    case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+    case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+    default:                  return false;
+  }
+}
+
+/**
+ * function to check for a right operand that leaves a number unchanged
+ *
+ * x - 0, x * 1 and x / 1 return x for every number x. x + 0 is left alone
+ * because -0 + 0 is 0.
+ */
+static bool isRightIdentity(TokenType operatorType, Value b) {
+  if (!IS_NUMBER(b)) return false;
+  switch (operatorType) {
+    case TOKEN_MINUS: return AS_NUMBER(b) == 0;
+    case TOKEN_STAR:
+    case TOKEN_SLASH: return AS_NUMBER(b) == 1;
+    default:          return false;
+  }
+}
+
 // function to parse binary expressions
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
+
+  ConstantLoad left;
+  bool leftIsConstant = lastConstantLoad(&left);
+  bool leftIsNumber = lastIsNumber();
+  int leftEnd = currentChunk()->count;
+
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  ConstantLoad right;
+  bool rightIsConstant = lastConstantLoad(&right) && right.start == leftEnd;
+  bool rightIsNumber = lastIsNumber();
+
+  if (leftIsConstant && rightIsConstant) {
+    refreshConstantLoad(&left);
+    Value result;
+    if (foldBinary(operatorType, left.value, right.value, &result)) {
+      discardConstantLoad(&right);
+      discardConstantLoad(&left);
+      emitConstant(result);
+      return;
+    }
+  }
+
+  if (leftIsNumber && rightIsConstant &&
+      isRightIdentity(operatorType, right.value)) {
+    discardConstantLoad(&right);
+    markNumber();
+    return;
+  }
+
+  // Both operands proven numbers: the unchecked *_NN forms will do.
+  bool numbers = leftIsNumber && rightIsNumber;
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
     case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_GREATER:
+      emitByte(numbers ? OP_GREATER_NN : OP_GREATER);
+      break;
+    case TOKEN_GREATER_EQUAL:
+      emitBytes(numbers ? OP_LESS_NN : OP_LESS, OP_NOT);
+      break;
+    case TOKEN_LESS:
+      emitByte(numbers ? OP_LESS_NN : OP_LESS);
+      break;
+    case TOKEN_LESS_EQUAL:
+      emitBytes(numbers ? OP_GREATER_NN : OP_GREATER, OP_NOT);
+      break;
+    case TOKEN_PLUS:
+      emitByte(numbers ? OP_ADD_NN : OP_ADD);
+      if (numbers) markNumber();
+      return;
+    case TOKEN_MINUS:
+      emitByte(numbers ? OP_SUBTRACT_NN : OP_SUBTRACT);
+      markNumber();
+      return;
+    case TOKEN_STAR:
+      emitByte(numbers ? OP_MULTIPLY_NN : OP_MULTIPLY);
+      markNumber();
+      return;
+    case TOKEN_SLASH:
+      emitByte(numbers ? OP_DIVIDE_NN : OP_DIVIDE);
+      markNumber();
+      return;
     default: return; // Unreachable.
   }
+  markType(TYPE_BOOL);
 }
 
 // function to parse literal
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitConstant(NIL_VAL); break;
+    case TOKEN_TRUE: emitConstant(BOOL_VAL(true)); break;
     default: return; // Unreachable.
   }
 }
@@ -360,13 +1139,11 @@ static void number(bool canAssign) {
 
 // function to handle or operator
 static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+  int endJump = emitJump(OP_JUMP_IF_TRUE);
 
-  patchJump(elseJump);
   emitByte(OP_POP);
-
   parsePrecedence(PREC_OR);
+
   patchJump(endJump);
 }
 
@@ -377,22 +1154,43 @@ static void string(bool canAssign) {
 
 // helper function for variable
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
   int arg = resolveLocal(current, &name);
+  NamedConstant* constant = resolveConstant(&name, arg);
+  if (constant != NULL) {
+    if (canAssign && match(TOKEN_EQUAL)) {
+      error("Can't assign to constant.");
+      return;
+    }
+    emitConstant(constant->value);
+    return;
+  }
+
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = OP_GET_GLOBAL_LONG;
+    setLongOp = OP_SET_GLOBAL_LONG;
   }  
   
+  Local* local = getOp == OP_GET_LOCAL ? &current->locals[arg] : NULL;
+  bool assigned = canAssign && check(TOKEN_EQUAL);
+  if (local == NULL) logGlobalAccess(name, arg, assigned);
   if(canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, arg);
+    StaticType type = lastType();
+    if (local != NULL) checkLocalType(local, type);
+    emitOperand(setOp, setLongOp, arg);
+    markType(type);
   } else {
-    emitBytes(getOp, arg);
+    emitOperand(getOp, getLongOp, arg);
+    if (local != NULL) markType(local->type);
   }
 }
 
@@ -404,14 +1202,33 @@ static void variable(bool canAssign) {
 // function to parse unary expressions
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
+  int operandStart = currentChunk()->count;
 
   // Compile the operand.
   parsePrecedence(PREC_UNARY);
 
+  // Fold the operator into a constant operand.
+  ConstantLoad operand;
+  if (lastConstantLoad(&operand) && operand.start == operandStart) {
+    if (operatorType == TOKEN_BANG) {
+      discardConstantLoad(&operand);
+      emitConstant(BOOL_VAL(isFalseyConstant(operand.value)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value)) {
+      discardConstantLoad(&operand);
+      emitConstant(NUMBER_VAL(-AS_NUMBER(operand.value)));
+      return;
+    }
+  }
+
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(OP_NOT); markType(TYPE_BOOL); break;
+    case TOKEN_MINUS:
+      emitByte(lastIsNumber() ? OP_NEGATE_NN : OP_NEGATE);
+      markNumber();
+      break;
     default: return; // Unreachable.
   }
 }
@@ -429,7 +1246,7 @@ ParseRule rules[] = {
   [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
   [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
   [TOKEN_BANG]          = {unary,     NULL,  PREC_NONE},
-  [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_NONE},
+  [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
@@ -439,15 +1256,16 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     and_,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,      or_,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,      or_,   PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
@@ -505,7 +1323,7 @@ static void block() {
 
 // function to handle variable declarations
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -517,6 +1335,53 @@ static void varDeclaration() {
   defineVariable(global);
 }
 
+/**
+ * function to handle const declarations
+ *
+ * The initializer must fold down to a single constant load. That load is
+ * removed again and the value kept in the compiler, so the declaration
+ * emits no code and every reference compiles to the value itself.
+ */
+static void constDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect constant name.");
+  Token name = parser.previous;
+  if (constantInScope(&name)) {
+    error("Already a constant with this name in this scope.");
+  } else if (current->scopeDepth > 0 && localInScope(&name)) {
+    error("Already a variable with this name in this scope.");
+  }
+
+  consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+  int start = currentChunk()->count;
+  expression();
+
+  ConstantLoad load;
+  if (!lastConstantLoad(&load) || load.start != start) {
+    error("Const initializer must be a constant expression.");
+    return;
+  }
+
+  // Grow before the load is discarded: the value may be a string only the
+  // constant pool refers to, and growing can collect.
+  if (current->namedConstantCapacity < current->namedConstantCount + 1) {
+    int oldCapacity = current->namedConstantCapacity;
+    current->namedConstantCapacity = GROW_CAPACITY(oldCapacity);
+    current->namedConstants = GROW_ARRAY(NamedConstant,
+                                         current->namedConstants, oldCapacity,
+                                         current->namedConstantCapacity);
+  }
+  NamedConstant* constant =
+      &current->namedConstants[current->namedConstantCount++];
+  constant->name = name;
+  constant->depth = current->scopeDepth;
+  constant->value = load.value;
+  constant->localCount = current->localCount;
+
+  discardConstantLoad(&load);
+  current->lastTypeEnd = -1;
+  consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+}
+
 
 // function to handle expression statements
 static void expressionStatement() {
@@ -525,52 +1390,272 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
-// function to handle for statement
+/**
+ * function to start a loop, loading the globals it hoists into hidden locals
+ *
+ * A hidden local is named after its global, so reads of the global in the
+ * loop resolve to it. Call inside the scope the loop's locals go in.
+ */
+static void beginLoop(Loop* loop) {
+  loop->number = current->loopCount++;
+  loop->firstAccess = current->accessCount;
+  current->loopDepth++;
+
+  LoopHoists* loopHoists = current->loopHoists;
+  if (!loopHoists->known) return;
+  while (current->nextHoist < loopHoists->count &&
+         loopHoists->hoists[current->nextHoist].loop < loop->number) {
+    current->nextHoist++;
+  }
+  while (current->nextHoist < loopHoists->count &&
+         loopHoists->hoists[current->nextHoist].loop == loop->number) {
+    Token name = loopHoists->hoists[current->nextHoist++].name;
+    // An enclosing loop hoisted it already.
+    if (resolveLocal(current, &name) != -1) continue;
+
+    emitOperand(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, identifierGlobal(&name));
+    if (addLocal(name) != NULL) markInitialized();
+  }
+}
+
+/**
+ * function to end a loop, finding the globals it should hoist
+ *
+ * A global qualifies when a top-level var defined it before the loop and
+ * the loop reads it but never assigns it. Nothing else can change a global
+ * while the loop runs, and the read before the loop cannot fail, so the
+ * "Undefined variable" error is untouched. The loop only hoists in the next
+ * pass, which compile() runs when some loop qualifies.
+ */
+static void endLoop(Loop* loop) {
+  current->loopDepth--;
+  LoopHoists* loopHoists = current->loopHoists;
+  if (loopHoists->known) return;
+
+  GlobalAccess* accesses = current->accesses;
+  uint8_t* flags = current->globalFlags;
+  for (int i = loop->firstAccess; i < current->accessCount; i++) {
+    if (accesses[i].assigned) flags[accesses[i].slot] |= GLOBAL_ASSIGNED;
+  }
+  for (int i = loop->firstAccess; i < current->accessCount; i++) {
+    if (flags[accesses[i].slot] != GLOBAL_DEFINED) continue;
+    flags[accesses[i].slot] |= GLOBAL_HOISTED;
+
+    if (loopHoists->capacity < loopHoists->count + 1) {
+      int oldCapacity = loopHoists->capacity;
+      loopHoists->capacity = GROW_CAPACITY(oldCapacity);
+      loopHoists->hoists = GROW_ARRAY(Hoist, loopHoists->hoists,
+                                      oldCapacity, loopHoists->capacity);
+    }
+    Hoist* hoist = &loopHoists->hoists[loopHoists->count++];
+    hoist->loop = loop->number;
+    hoist->name = accesses[i].name;
+  }
+  for (int i = loop->firstAccess; i < current->accessCount; i++) {
+    flags[accesses[i].slot] &= GLOBAL_DEFINED;
+  }
+
+  if (current->loopDepth == 0) current->accessCount = 0;
+}
+
+/**
+ * function to recognise a counted loop in the clauses of a for statement
+ *
+ * Matches the code compiled for the clauses, not the source, so anything
+ * folding or the peephole pass could change is already settled:
+ *
+ *   condition: OP_GET_LOCAL i, OP_CONSTANT limit | OP_GET_LOCAL limit,
+ *              OP_LESS | OP_GREATER, optional OP_NOT
+ *   increment: OP_GET_LOCAL i, OP_CONSTANT step, OP_ADD | OP_SUBTRACT,
+ *              OP_SET_LOCAL i, OP_POP
+ *
+ * where i is the variable declared by the initializer and step is a number.
+ * On success fills operands with the four operand bytes of OP_FORPREP and
+ * OP_FORLOOP: counter slot, ForFlags, limit and step constant.
+ */
+static bool countedLoop(int counter, Fragment* condition,
+                        Fragment* increment, uint8_t* operands) {
+  // Long jump mode is for huge chunks; those keep the general loop.
+  if (counter < 0 || counter > UINT8_MAX || current->longJumps) return false;
+
+  uint8_t* test = condition->code;
+  if (condition->count != 5 && condition->count != 6) return false;
+  if (test[0] != OP_GET_LOCAL || test[1] != counter) return false;
+
+  uint8_t flags;
+  if (test[2] == OP_GET_LOCAL) {
+    flags = FOR_LIMIT_LOCAL;
+  } else if (test[2] == OP_CONSTANT) {
+    flags = 0;
+  } else {
+    return false;
+  }
+
+  bool negated = condition->count == 6;
+  if (negated && test[5] != OP_NOT) return false;
+  switch (test[4]) {
+    case OP_LESS:
+    case OP_LESS_NN:
+      flags |= negated ? FOR_GREATER_EQUAL : FOR_LESS;
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NN:
+      flags |= negated ? FOR_LESS_EQUAL : FOR_GREATER;
+      break;
+    default: return false;
+  }
+
+  uint8_t* step = increment->code;
+  if (increment->count != 8 ||
+      step[0] != OP_GET_LOCAL || step[1] != counter ||
+      step[2] != OP_CONSTANT ||
+      !IS_NUMBER(currentChunk()->constants.values[step[3]]) ||
+      step[5] != OP_SET_LOCAL || step[6] != counter ||
+      step[7] != OP_POP) {
+    return false;
+  }
+  switch (step[4]) {
+    case OP_ADD:
+    case OP_ADD_NN:      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NN: flags |= FOR_STEP_SUBTRACT; break;
+    default: return false;
+  }
+
+  operands[0] = (uint8_t)counter;
+  operands[1] = flags;
+  operands[2] = test[3];
+  operands[3] = step[3];
+  return true;
+}
+
+/**
+ * function to emit OP_FORPREP or OP_FORLOOP with a placeholder offset
+ *
+ * The offset bytes get testLine, so the runtime can blame the limit test
+ * on the condition and a bad step on the increment of the same instruction.
+ */
+static void emitForInstruction(uint8_t instruction, uint8_t* operands,
+                               int line, int testLine) {
+  writeChunk(currentChunk(), instruction, line);
+  for (int i = 0; i < 4; i++) writeChunk(currentChunk(), operands[i], line);
+  writeChunk(currentChunk(), 0xff, testLine);
+  writeChunk(currentChunk(), 0xff, testLine);
+}
+
+/**
+ * function to compile the body of a counted loop
+ *
+ *   OP_FORPREP exit     test the counter once on entry
+ * body:
+ *   body
+ *   OP_FORLOOP body     step, test and branch back in one instruction
+ * exit:
+ *
+ * Both read the counter and a local limit from their slots every time, so
+ * a body that assigns to them behaves as in the general loop.
+ */
+static void countedLoopBody(uint8_t* operands, Fragment* condition,
+                            Fragment* increment) {
+  int conditionLine = condition->lines[0];
+  int incrementLine = increment->lines[0];
+  freeFragment(condition);
+  freeFragment(increment);
+
+  emitForInstruction(OP_FORPREP, operands, conditionLine, conditionLine);
+  int exitJump = currentChunk()->count - 2;
+  int bodyStart = currentChunk()->count;
+  statement();
+
+  emitForInstruction(OP_FORLOOP, operands, incrementLine, conditionLine);
+  int offset = currentChunk()->count - bodyStart;
+  if (offset > UINT16_MAX) {
+    // Too far for OP_FORLOOP; compile() retries with the general loop.
+    current->jumpOverflow = true;
+  } else {
+    currentChunk()->code[currentChunk()->count - 2] = (offset >> 8) & 0xff;
+    currentChunk()->code[currentChunk()->count - 1] = offset & 0xff;
+  }
+
+  patchJump(exitJump);
+}
+
+/**
+ * function to handle for statement
+ *
+ * The loop is inverted: the condition and increment are cut out and
+ * emitted after the body, so each iteration ends in one conditional
+ * backward branch.
+ *
+ *   initializer
+ *   OP_JUMP condition
+ * body:
+ *   body, increment
+ * condition:
+ *   condition
+ *   OP_POP_LOOP_IF_TRUE body
+ *
+ * Counted loops over a local get OP_FORPREP/OP_FORLOOP instead.
+ */
 static void forStatement() {
   beginScope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   // initializer clause
+  int counter = -1;
   if(match(TOKEN_SEMICOLON)) {
     // no initializer.
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
+    counter = current->localCount - 1;
   } else {
     expressionStatement();
   }
 
-  int loopStart = currentChunk()->count;
-  int exitJump = -1;
+  Loop loop;
+  beginLoop(&loop);
+
   // condition clause
+  Fragment condition = {NULL, NULL, 0};
   if (!match(TOKEN_SEMICOLON)) {
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+    cutFragment(conditionStart, &condition);
   }
 
   // increment clause
+  Fragment increment = {NULL, NULL, 0};
   if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
     int incrementStart = currentChunk()->count;
     expression();
     emitByte(OP_POP);
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    cutFragment(incrementStart, &increment);
+  }
 
-    emitLoop(loopStart);
-    loopStart = incrementStart;
-    patchJump(bodyJump);
+  uint8_t operands[4];
+  if (countedLoop(counter, &condition, &increment, operands)) {
+    countedLoopBody(operands, &condition, &increment);
+    endLoop(&loop);
+    endScope();
+    return;
   }
 
+  bool hasCondition = condition.count > 0;
+  int conditionJump = hasCondition ? emitJump(OP_JUMP) : -1;
+  int bodyStart = currentChunk()->count;
   statement();
-  emitLoop(loopStart);
+  pasteFragment(&increment);
 
-  if(exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
+  if (hasCondition) {
+    patchJump(conditionJump);
+    pasteFragment(&condition);
+    emitLoop(OP_POP_LOOP_IF_TRUE, bodyStart);
+  } else {
+    emitLoop(OP_LOOP, bodyStart);
   }
 
+  endLoop(&loop);
   endScope();
 }
 
@@ -580,17 +1665,17 @@ static void ifStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
 
-  int elseJump = emitJump(OP_JUMP);
-
-  patchJump(thenJump);
-  emitByte(OP_POP);
-
-  if(match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
+  if (match(TOKEN_ELSE)) {
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    statement();
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
+  }
 }
 
 // function to handle print statements
@@ -600,20 +1685,36 @@ static void printStatement() {
   emitByte(OP_PRINT);
 }
 
-// function to handle while statement
+/**
+ * function to handle while statement
+ *
+ * Inverted like forStatement(): the condition is compiled, cut out and
+ * emitted again after the body. The scope holds the hidden locals of
+ * hoisted globals.
+ */
 static void whileStatement() {
-  int loopStart = currentChunk()->count;
+  beginScope();
+  Loop loop;
+  beginLoop(&loop);
+
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  int conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  Fragment condition;
+  cutFragment(conditionStart, &condition);
+
+  int conditionJump = emitJump(OP_JUMP);
+  int bodyStart = currentChunk()->count;
   statement();
-  emitLoop(loopStart);
 
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  patchJump(conditionJump);
+  pasteFragment(&condition);
+  emitLoop(OP_POP_LOOP_IF_TRUE, bodyStart);
+
+  endLoop(&loop);
+  endScope();
 }
 
 // function to synchronize compile time errors
@@ -624,6 +1725,7 @@ static void synchronize() {
     if (parser.previous.type == TOKEN_SEMICOLON) return;
     switch (parser.current.type) {
       case TOKEN_CLASS:
+      case TOKEN_CONST:
       case TOKEN_FUN:
       case TOKEN_VAR:
       case TOKEN_FOR:
@@ -647,11 +1749,14 @@ static void synchronize() {
  * declaration    → classDecl
                   | funDecl
                   | varDecl
+                  | constDecl
                   | statement ;
  */
 static void declaration() {
   if(match(TOKEN_VAR)) {
     varDeclaration();
+  } else if (match(TOKEN_CONST)) {
+    constDeclaration();
   } else {
     statement();
   }
@@ -689,6 +1794,37 @@ static void statement() {
   }
 }
 
+// function to order hoisted globals by loop for qsort()
+static int compareHoists(const void* a, const void* b) {
+  const Hoist* left = a;
+  const Hoist* right = b;
+  if (left->loop != right->loop) return left->loop < right->loop ? -1 : 1;
+  if (left->name.start == right->name.start) return 0;
+  return left->name.start < right->name.start ? -1 : 1;
+}
+
+/**
+ * function to mark the values the compiler holds outside the chunk
+ *
+ * The chunk's own constants are marked through vm.chunk; consts are
+ * folded out of the constant pool and only kept here.
+ */
+void markCompilerRoots() {
+  if (current == NULL) return;
+  for (int i = 0; i < current->namedConstantCount; i++) {
+    markValue(current->namedConstants[i].value);
+  }
+}
+
+// function to update the consts the compiler holds after collectYoung()
+// moved them
+void forwardCompilerRoots() {
+  if (current == NULL) return;
+  for (int i = 0; i < current->namedConstantCount; i++) {
+    forwardValue(&current->namedConstants[i].value);
+  }
+}
+
 /**
  * function to compile source
  * statement   → exprStmt
@@ -705,26 +1841,52 @@ static void statement() {
    declaration → classDecl
                | funDecl
                | varDecl
+               | constDecl
                | statement ;
  */
 bool compile(const char* source, Chunk* chunk) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler);
-  compilingChunk = chunk;
-
-  parser.hadError = false;
-  parser.panicMode = false;
+  bool longJumps = false;
+  LocalTypes localTypes = {NULL, 0, 0};
+  LoopHoists loopHoists = {false, NULL, 0, 0};
+  for (;;) {
+    initScanner(source);
+    Compiler compiler;
+    initCompiler(&compiler, longJumps, &localTypes, &loopHoists);
+    compilingChunk = chunk;
+    vm.chunk = chunk;
+
+    parser.hadError = false;
+    parser.panicMode = false;
 
-  advance();
+    advance();
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
-  }
+    while (!match(TOKEN_EOF)) {
+      declaration();
+    }
   
 
-  endCompiler();
-  return !parser.hadError;
+    endCompiler();
+    if (parser.hadError || passIsFinal()) {
+      FREE_ARRAY(bool, localTypes.untyped, localTypes.capacity);
+      FREE_ARRAY(Hoist, loopHoists.hoists, loopHoists.capacity);
+      current = NULL;
+      return !parser.hadError;
+    }
+
+    // A forward jump did not fit in 16 bits: compile again with every
+    // forward jump in its *_LONG form. A local's static type was wrong:
+    // compile again with that local untyped, or with no typed locals after
+    // two such passes. Loops have globals to hoist: compile again hoisting
+    // them. Each pass fixes at least one of them for good, so this ends
+    // after a handful of passes.
+    freeChunk(chunk);
+    if (compiler.jumpOverflow) longJumps = true;
+    if (compiler.typeConflict) localTypes.conflictPasses++;
+    if (!loopHoists.known && loopHoists.count > 0) {
+      qsort(loopHoists.hoists, loopHoists.count, sizeof(Hoist), compareHoists);
+    }
+    loopHoists.known = true;
+  }
 }
 
 
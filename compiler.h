@@ -6,5 +6,7 @@
 
 // function declaration for compiler
 bool compile(const char* source, Chunk* chunk);
+void markCompilerRoots();
+void forwardCompilerRoots();
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 /**
  * function disassemble chunk to view byte_code
@@ -26,6 +27,25 @@ static int constantInstruction(const char* name, Chunk* chunk,
     return offset + 2;
 }
 
+// function to read the three byte operand of a *_LONG instruction
+static uint32_t readLong(Chunk* chunk, int offset) {
+    return (uint32_t)(chunk->code[offset + 1] << 16) |
+           (uint32_t)(chunk->code[offset + 2] << 8) |
+           chunk->code[offset + 3];
+}
+
+/**
+ * function to print long constant instruction
+ */
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    uint32_t constant = readLong(chunk, offset);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 /**
  * function to print simple instruction
  */
@@ -34,6 +54,26 @@ static int simpleInstruction(const char* name, int offset){
     return offset + 1;
 }
 
+// function to print global variable instruction
+static int globalInstruction(const char* name, Chunk* chunk,
+                             int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 2;
+}
+
+// function to print long global variable instruction
+static int globalLongInstruction(const char* name, Chunk* chunk,
+                                 int offset) {
+  uint32_t slot = readLong(chunk, offset);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 4;
+}
+
 // function to print byte instruction
 static int byteInstruction(const char* name, Chunk* chunk,
                            int offset) {
@@ -52,15 +92,54 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
+// function to print long jump instruction
+static int jumpLongInstruction(const char* name, int sign,
+                               Chunk* chunk, int offset) {
+  uint32_t jump = readLong(chunk, offset);
+  printf("%-16s %4d -> %d\n", name, offset,
+         offset + 4 + sign * (int)jump);
+  return offset + 4;
+}
+
+// function to print long local variable instruction
+static int longInstruction(const char* name, Chunk* chunk,
+                           int offset) {
+  uint32_t slot = readLong(chunk, offset);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+// function to print OP_FORPREP or OP_FORLOOP
+static int forInstruction(const char* name, int sign,
+                          Chunk* chunk, int offset) {
+  uint8_t* operands = &chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(operands[4] << 8);
+  jump |= operands[5];
+
+  static const char* compares[] = {"<", "<=", ">", ">="};
+  printf("%-16s %4d %s ", name, operands[0],
+         compares[operands[1] & FOR_COMPARE_MASK]);
+  if (operands[1] & FOR_LIMIT_LOCAL) {
+    printf("local %d", operands[2]);
+  } else {
+    printValue(chunk->constants.values[operands[2]]);
+  }
+  printf(" %s ", operands[1] & FOR_STEP_SUBTRACT ? "-=" : "+=");
+  printValue(chunk->constants.values[operands[3]]);
+  printf(" -> %d\n", offset + 7 + sign * jump);
+  return offset + 7;
+}
+
 /**
  * function disassemble single instruction
  */
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -81,11 +160,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);    
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);    
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);    
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);    
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -110,10 +189,96 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);  
+        case OP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);           
+        case OP_POP_LOOP_IF_TRUE:
+            return jumpInstruction("OP_POP_LOOP_IF_TRUE", -1, chunk, offset);
+        case OP_FORPREP:
+            return forInstruction("OP_FORPREP", 1, chunk, offset);
+        case OP_FORLOOP:
+            return forInstruction("OP_FORLOOP", -1, chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_TRUE_LONG", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_POP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_POP_LOOP_IF_TRUE_LONG:
+            return jumpLongInstruction("OP_POP_LOOP_IF_TRUE_LONG", -1, chunk, offset);
+        case OP_POP_JUMP_IF_TRUE_LONG:
+            return jumpLongInstruction("OP_POP_JUMP_IF_TRUE_LONG", 1, chunk, offset);
+        case OP_POP_LOOP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_POP_LOOP_IF_FALSE_LONG", -1, chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_POPN:
+            return byteInstruction("OP_POPN", chunk, offset);
+        case OP_POP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_POP_LOOP_IF_FALSE:
+            return jumpInstruction("OP_POP_LOOP_IF_FALSE", -1, chunk, offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GREATER_EQUAL_NUM:
+            return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+        case OP_LESS_EQUAL_NUM:
+            return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_NEGATE_NUM:
+            return simpleInstruction("OP_NEGATE_NUM", offset);
+        case OP_GREATER_NN:
+            return simpleInstruction("OP_GREATER_NN", offset);
+        case OP_LESS_NN:
+            return simpleInstruction("OP_LESS_NN", offset);
+        case OP_GREATER_EQUAL_NN:
+            return simpleInstruction("OP_GREATER_EQUAL_NN", offset);
+        case OP_LESS_EQUAL_NN:
+            return simpleInstruction("OP_LESS_EQUAL_NN", offset);
+        case OP_ADD_NN:
+            return simpleInstruction("OP_ADD_NN", offset);
+        case OP_SUBTRACT_NN:
+            return simpleInstruction("OP_SUBTRACT_NN", offset);
+        case OP_MULTIPLY_NN:
+            return simpleInstruction("OP_MULTIPLY_NN", offset);
+        case OP_DIVIDE_NN:
+            return simpleInstruction("OP_DIVIDE_NN", offset);
+        case OP_NEGATE_NN:
+            return simpleInstruction("OP_NEGATE_NN", offset);
         
         default:
             printf("Unknown opcode %d\n", instruction);
@@ -0,0 +1,1008 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef JIT
+
+/**
+ * Machine code for one loop. It is called with the VM stack, the global
+ * slots and &vm.stackTop, runs the loop until it leaves it or a guard
+ * fails, stores the stack top the interpreter should continue with and
+ * returns the bytecode offset to continue at.
+ */
+typedef uint32_t (*JitFunction)(Value* stack, Value* globals,
+                                Value** stackTop);
+
+/**
+ * Structure of the JIT state of one loop header
+ *
+ * hits "back-edges the interpreter has taken to this header"
+ * function "machine code for the loop, NULL until it is compiled"
+ * size "bytes mapped for function"
+ * failed "the loop uses an instruction the JIT cannot translate"
+ */
+typedef struct {
+    int hits;
+    JitFunction function;
+    size_t size;
+    bool failed;
+} JitLoop;
+
+// Loop state of the chunk being run, indexed by header offset.
+static Chunk* jitChunk = NULL;
+static JitLoop* loops = NULL;
+static int loopCount = 0;
+
+// x86-64 registers, numbered as in the instruction encoding.
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// Condition codes used with ucomisd; the other one is always code ^ 1.
+#define CC_ABOVE       0x7
+#define CC_BELOW_EQUAL 0x6
+#define CC_EQUAL       0x4
+
+/**
+ * Register use in the generated code
+ *
+ * rbx "vm.stack, the base of the locals"
+ * r12 "vm.stackTop at loop entry; temporaries live at r12 + depth * 8"
+ * r13 "vm.globalValues.values"
+ * r14 "QNAN, for the number guards"
+ * r15 "&vm.stackTop, written back on exit"
+ */
+#define STACK_BASE   RBX
+#define ENTRY_TOP    R12
+#define GLOBALS      R13
+#define QNAN_BITS    R14
+#define STACK_TOP    R15
+
+/**
+ * Structure of one decoded instruction of the loop
+ *
+ * offset "offset of the instruction in the chunk"
+ * opcode "the instruction"
+ * operand "constant index, slot or pop count"
+ * target "offset a jump lands on, -1 for other instructions"
+ */
+typedef struct {
+    int offset;
+    uint8_t opcode;
+    uint32_t operand;
+    int target;
+} JitInstruction;
+
+/**
+ * Structure of a rel32 field waiting for its destination
+ *
+ * at "offset of the rel32 field in the generated code"
+ * target "chunk offset the jump goes to"
+ * depth "stack depth at the jump, for exits"
+ * exit "leave the loop and continue in the interpreter at target"
+ */
+typedef struct {
+    int at;
+    int target;
+    int depth;
+    bool exit;
+} Patch;
+
+/**
+ * Structure of the state while one loop is translated
+ *
+ * code "generated machine code"
+ * native "offset in code of each instruction, by offset from header"
+ * depthAt "stack depth on arrival at each instruction, -1 if not known yet"
+ * isTarget "some jump in the loop lands on the instruction"
+ * known "the stack slot at each depth is known to hold a number"
+ * failed "the loop cannot be translated"
+ */
+typedef struct {
+    Chunk* chunk;
+    int header;
+    int end;
+
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    JitInstruction* instructions;
+    int instructionCount;
+    int* native;
+    int* depthAt;
+    bool* isTarget;
+    bool* known;
+
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+
+    bool failed;
+} Assembler;
+
+// function to append one byte of machine code
+static void emit(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+// function to append a little-endian 32-bit value
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+// function to append a little-endian 64-bit value
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+// function to emit "op reg, [base + disp32]" or the reverse with REX.W
+static void emitMemory(Assembler* as, uint8_t op, int reg, int base,
+                       int32_t disp) {
+    emit(as, 0x48 | (reg >= R8 ? 4 : 0) | (base >= R8 ? 1 : 0));
+    emit(as, op);
+    emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+// function to emit "op dst, src" for a two register instruction with REX.W
+static void emitRegisters(Assembler* as, uint8_t op, int dst, int src) {
+    emit(as, 0x48 | (src >= R8 ? 4 : 0) | (dst >= R8 ? 1 : 0));
+    emit(as, op);
+    emit(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// function to load a 64-bit register from [base + disp]
+static void emitLoad(Assembler* as, int reg, int base, int32_t disp) {
+    emitMemory(as, 0x8b, reg, base, disp);
+}
+
+// function to store a 64-bit register to [base + disp]
+static void emitStore(Assembler* as, int base, int32_t disp, int reg) {
+    emitMemory(as, 0x89, reg, base, disp);
+}
+
+// function to load a 64-bit immediate into a register
+static void emitImmediate(Assembler* as, int reg, uint64_t value) {
+    emit(as, 0x48 | (reg >= R8 ? 1 : 0));
+    emit(as, 0xb8 + (reg & 7));
+    emit64(as, value);
+}
+
+// function to emit movq xmm, r64
+static void emitToXmm(Assembler* as, int xmm, int reg) {
+    emit(as, 0x66);
+    emit(as, 0x48);
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    emit(as, 0xc0 | (xmm << 3) | reg);
+}
+
+// function to emit movq r64, xmm
+static void emitFromXmm(Assembler* as, int reg, int xmm) {
+    emit(as, 0x66);
+    emit(as, 0x48);
+    emit(as, 0x0f);
+    emit(as, 0x7e);
+    emit(as, 0xc0 | (xmm << 3) | reg);
+}
+
+// function to emit a scalar double instruction on two xmm registers
+static void emitSse(Assembler* as, uint8_t prefix, uint8_t op, int dst,
+                    int src) {
+    emit(as, prefix);
+    emit(as, 0x0f);
+    emit(as, op);
+    emit(as, 0xc0 | (dst << 3) | src);
+}
+
+// function to emit a call to a C function through rax
+static void emitCall(Assembler* as, void* function) {
+    emitImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    emit(as, 0xff);
+    emit(as, 0xd0);
+}
+
+// function to turn the condition code in flags into a boolean Value in rax
+static void emitBoolean(Assembler* as, int cc) {
+    emit(as, 0x0f);
+    emit(as, 0x90 | cc);       // setcc al
+    emit(as, 0xc0);
+    emit(as, 0x0f);
+    emit(as, 0xb6);            // movzx eax, al
+    emit(as, 0xc0);
+    // BOOL_VAL(b) is FALSE_VAL + b.
+    emitImmediate(as, RCX, FALSE_VAL);
+    emitRegisters(as, 0x01, RAX, RCX);
+}
+
+// function to get the address of a temporary stack slot
+static int32_t slotAt(int depth) {
+    return depth * (int32_t)sizeof(Value);
+}
+
+// function to record a rel32 field to be filled in once code is laid out
+static void addPatch(Assembler* as, int target, int depth, bool exit) {
+    if (as->patchCapacity < as->patchCount + 1) {
+        int oldCapacity = as->patchCapacity;
+        as->patchCapacity = GROW_CAPACITY(oldCapacity);
+        as->patches = GROW_ARRAY(Patch, as->patches, oldCapacity,
+                                 as->patchCapacity);
+    }
+    Patch* patch = &as->patches[as->patchCount++];
+    patch->at = as->count;
+    patch->target = target;
+    patch->depth = depth;
+    patch->exit = exit;
+    emit32(as, 0);
+}
+
+// function to check whether a chunk offset lies inside the loop
+static bool inLoop(Assembler* as, int offset) {
+    return offset >= as->header && offset < as->end;
+}
+
+/**
+ * function to emit a jump to a chunk offset
+ *
+ * cc is the condition code, or -1 for an unconditional jump. Jumps inside
+ * the loop go to its machine code; any other jump leaves the loop.
+ */
+static void emitJumpTo(Assembler* as, int cc, int target, int depth) {
+    if (cc == -1) {
+        emit(as, 0xe9);
+    } else {
+        emit(as, 0x0f);
+        emit(as, 0x80 | cc);
+    }
+
+    if (!inLoop(as, target)) {
+        addPatch(as, target, depth, true);
+        return;
+    }
+
+    int* arrival = &as->depthAt[target - as->header];
+    if (*arrival == -1) {
+        *arrival = depth;
+    } else if (*arrival != depth) {
+        as->failed = true;
+    }
+    addPatch(as, target, depth, false);
+}
+
+// function to leave the loop before the instruction at offset if cc holds
+static void emitGuardExit(Assembler* as, int cc, int offset, int depth) {
+    emit(as, 0x0f);
+    emit(as, 0x80 | cc);
+    addPatch(as, offset, depth, true);
+}
+
+// function to exit at offset unless the value in reg is a number
+static void emitNumberGuard(Assembler* as, int reg, int offset, int depth) {
+    emitRegisters(as, 0x89, RDX, reg);
+    emitRegisters(as, 0x21, RDX, QNAN_BITS);
+    emitRegisters(as, 0x39, RDX, QNAN_BITS);
+    emitGuardExit(as, CC_EQUAL, offset, depth);
+}
+
+// function to exit at offset if the value in reg is an object, so that the
+// interpreter stores it through writeBarrier()
+static void emitObjectGuard(Assembler* as, int reg, int offset, int depth) {
+    emitImmediate(as, RCX, SIGN_BIT | QNAN);
+    emitRegisters(as, 0x89, RDX, reg);
+    emitRegisters(as, 0x21, RDX, RCX);
+    emitRegisters(as, 0x39, RDX, RCX);
+    emitGuardExit(as, CC_EQUAL, offset, depth);
+}
+
+/**
+ * function to branch on the truthiness of the value in rax
+ *
+ * Only nil and false are falsey, and they are NIL_VAL and NIL_VAL + 1, so
+ * rax - NIL_VAL <= 1 (unsigned) exactly when the value is falsey.
+ */
+static void emitTruthJump(Assembler* as, bool ifTruthy, int target,
+                          int depth) {
+    emitImmediate(as, RCX, NIL_VAL);
+    emitRegisters(as, 0x29, RAX, RCX);
+    emit(as, 0x48);
+    emit(as, 0x83);
+    emit(as, 0xf8);           // cmp rax, 1
+    emit(as, 0x01);
+    emitJumpTo(as, ifTruthy ? CC_ABOVE : CC_BELOW_EQUAL, target, depth);
+}
+
+/**
+ * function to compare xmm0 (a) with xmm1 (b) for a comparison opcode
+ *
+ * Returns the condition code that holds when the comparison is true. <=
+ * and >= are !(a > b) and !(a < b), as in the interpreter, so an unordered
+ * result makes them true.
+ */
+static int emitCompare(Assembler* as, uint8_t opcode) {
+    switch (opcode) {
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_GREATER_NN:
+            emitSse(as, 0x66, 0x2e, 0, 1);
+            return CC_ABOVE;
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_LESS_NN:
+            emitSse(as, 0x66, 0x2e, 1, 0);
+            return CC_ABOVE;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM:
+        case OP_LESS_EQUAL_NN:
+            emitSse(as, 0x66, 0x2e, 0, 1);
+            return CC_BELOW_EQUAL;
+        default:
+            emitSse(as, 0x66, 0x2e, 1, 0);
+            return CC_BELOW_EQUAL;
+    }
+}
+
+// function to map OP_FORLOOP's comparison flags to a comparison opcode
+static uint8_t forCompareOpcode(uint8_t flags) {
+    switch (flags & FOR_COMPARE_MASK) {
+        case FOR_LESS:       return OP_LESS;
+        case FOR_LESS_EQUAL: return OP_LESS_EQUAL;
+        case FOR_GREATER:    return OP_GREATER;
+        default:             return OP_GREATER_EQUAL;
+    }
+}
+
+// function to check for an opcode whose operands the compiler proved numbers
+static bool isUnchecked(uint8_t opcode) {
+    return opcode >= OP_GREATER_NN && opcode <= OP_NEGATE_NN;
+}
+
+// function to check for a jump that pops its condition; sets *ifTruthy
+static bool isPoppingBranch(uint8_t opcode, bool* ifTruthy) {
+    switch (opcode) {
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_LOOP_IF_FALSE:
+        case OP_POP_LOOP_IF_FALSE_LONG:
+            *ifTruthy = false;
+            return true;
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+        case OP_POP_LOOP_IF_TRUE:
+        case OP_POP_LOOP_IF_TRUE_LONG:
+            *ifTruthy = true;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * function to decode the instructions of the loop
+ *
+ * Fails on any instruction the JIT has no template for.
+ */
+static bool decodeLoop(Assembler* as) {
+    uint8_t* code = as->chunk->code;
+    int offset = as->header;
+    while (offset < as->end) {
+        JitInstruction* instruction = &as->instructions[as->instructionCount++];
+        uint8_t opcode = code[offset];
+        uint8_t* operands = &code[offset + 1];
+        uint32_t shortOperand = (uint32_t)((operands[0] << 8) | operands[1]);
+        uint32_t longOperand = (uint32_t)((operands[0] << 16) |
+                                          (operands[1] << 8) | operands[2]);
+        int length;
+
+        instruction->offset = offset;
+        instruction->opcode = opcode;
+        instruction->operand = 0;
+        instruction->target = -1;
+
+        switch (opcode) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_PRINT:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+            case OP_ADD_NUM:
+            case OP_SUBTRACT_NUM:
+            case OP_MULTIPLY_NUM:
+            case OP_DIVIDE_NUM:
+            case OP_NEGATE_NUM:
+            case OP_GREATER_NN:
+            case OP_LESS_NN:
+            case OP_GREATER_EQUAL_NN:
+            case OP_LESS_EQUAL_NN:
+            case OP_ADD_NN:
+            case OP_SUBTRACT_NN:
+            case OP_MULTIPLY_NN:
+            case OP_DIVIDE_NN:
+            case OP_NEGATE_NN:
+                length = 1;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_POPN:
+                instruction->operand = operands[0];
+                length = 2;
+                break;
+            case OP_CONSTANT_LONG:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL_LONG:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+                instruction->operand = longOperand;
+                length = 4;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_TRUE:
+                length = 3;
+                instruction->target = offset + length + (int)shortOperand;
+                break;
+            case OP_LOOP:
+            case OP_POP_LOOP_IF_TRUE:
+            case OP_POP_LOOP_IF_FALSE:
+                length = 3;
+                instruction->target = offset + length - (int)shortOperand;
+                break;
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_JUMP_IF_TRUE_LONG:
+            case OP_POP_JUMP_IF_FALSE_LONG:
+            case OP_POP_JUMP_IF_TRUE_LONG:
+                length = 4;
+                instruction->target = offset + length + (int)longOperand;
+                break;
+            case OP_LOOP_LONG:
+            case OP_POP_LOOP_IF_TRUE_LONG:
+            case OP_POP_LOOP_IF_FALSE_LONG:
+                length = 4;
+                instruction->target = offset + length - (int)longOperand;
+                break;
+            case OP_FORPREP:
+            case OP_FORLOOP: {
+                length = 7;
+                int jump = (operands[4] << 8) | operands[5];
+                instruction->target = opcode == OP_FORPREP
+                                          ? offset + length + jump
+                                          : offset + length - jump;
+                // The limit must be a number, or the loop always exits.
+                if (!(operands[1] & FOR_LIMIT_LOCAL) &&
+                    !IS_NUMBER(as->chunk->constants.values[operands[2]])) {
+                    return false;
+                }
+                break;
+            }
+            default:
+                // OP_DEFINE_GLOBAL and OP_RETURN never run inside a loop.
+                return false;
+        }
+
+        if (instruction->target != -1 && inLoop(as, instruction->target)) {
+            as->isTarget[instruction->target - as->header] = true;
+        }
+        offset += length;
+    }
+    return offset == as->end;
+}
+
+// function to emit a binary arithmetic instruction
+static void emitArithmetic(Assembler* as, uint8_t op, int offset, int depth) {
+    emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 2));
+    emitLoad(as, RCX, ENTRY_TOP, slotAt(depth - 1));
+    if (!as->known[depth - 2]) emitNumberGuard(as, RAX, offset, depth);
+    if (!as->known[depth - 1]) emitNumberGuard(as, RCX, offset, depth);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    emitSse(as, 0xf2, op, 0, 1);
+    emitFromXmm(as, RAX, 0);
+    emitStore(as, ENTRY_TOP, slotAt(depth - 2), RAX);
+    as->known[depth - 2] = true;
+}
+
+// function to load the operands of a comparison into xmm0 and xmm1
+static void emitCompareOperands(Assembler* as, int offset, int depth) {
+    emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 2));
+    emitLoad(as, RCX, ENTRY_TOP, slotAt(depth - 1));
+    if (!as->known[depth - 2]) emitNumberGuard(as, RAX, offset, depth);
+    if (!as->known[depth - 1]) emitNumberGuard(as, RCX, offset, depth);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+}
+
+/**
+ * function to emit OP_FORPREP or OP_FORLOOP
+ *
+ * Both guards run before the counter is written, so a failed guard leaves
+ * the interpreter to run the whole instruction again.
+ */
+static void emitFor(Assembler* as, JitInstruction* instruction, int depth) {
+    uint8_t* operands = &as->chunk->code[instruction->offset + 1];
+    uint8_t slot = operands[0];
+    uint8_t flags = operands[1];
+    int offset = instruction->offset;
+
+    emitLoad(as, RAX, STACK_BASE, slotAt(slot));
+    emitNumberGuard(as, RAX, offset, depth);
+    if (flags & FOR_LIMIT_LOCAL) {
+        emitLoad(as, RCX, STACK_BASE, slotAt(operands[2]));
+        emitNumberGuard(as, RCX, offset, depth);
+    } else {
+        emitImmediate(as, RCX, as->chunk->constants.values[operands[2]]);
+    }
+    emitToXmm(as, 0, RAX);
+
+    if (instruction->opcode == OP_FORLOOP) {
+        emitImmediate(as, RDX, as->chunk->constants.values[operands[3]]);
+        emitToXmm(as, 1, RDX);
+        emitSse(as, 0xf2, flags & FOR_STEP_SUBTRACT ? 0x5c : 0x58, 0, 1);
+        emitFromXmm(as, RAX, 0);
+        emitStore(as, STACK_BASE, slotAt(slot), RAX);
+    }
+
+    emitToXmm(as, 1, RCX);
+    int cc = emitCompare(as, forCompareOpcode(flags));
+    if (instruction->opcode == OP_FORLOOP) {
+        emitJumpTo(as, cc, instruction->target, depth);
+    } else {
+        emitJumpTo(as, cc ^ 1, instruction->target, depth);
+    }
+}
+
+// function to print a value the way OP_PRINT does
+static void jitPrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+/**
+ * function to emit the body of the loop
+ *
+ * The stack depth at each instruction is known statically, so the
+ * templates address stack slots directly and only the exits write
+ * vm.stackTop.
+ */
+static void emitLoop(Assembler* as) {
+    Value* constants = as->chunk->constants.values;
+    int depth = 0;
+    bool reachable = true;
+    as->depthAt[0] = 0;
+
+    for (int i = 0; i < as->instructionCount && !as->failed; i++) {
+        JitInstruction* instruction = &as->instructions[i];
+        int index = instruction->offset - as->header;
+        int offset = instruction->offset;
+
+        if (!reachable) {
+            depth = as->depthAt[index];
+            if (depth == -1) {
+                as->failed = true;
+                return;
+            }
+        } else if (as->depthAt[index] != -1 && as->depthAt[index] != depth) {
+            as->failed = true;
+            return;
+        }
+        as->depthAt[index] = depth;
+        as->native[index] = as->count;
+        reachable = true;
+
+        if (as->isTarget[index]) {
+            memset(as->known, 0, sizeof(bool) * (as->end - as->header + 1));
+        }
+
+        // Room for the pushes of this instruction.
+        if (depth < 0 || depth + 1 > as->end - as->header) {
+            as->failed = true;
+            return;
+        }
+
+        // The unchecked forms need no guards on their operands.
+        if (isUnchecked(instruction->opcode)) {
+            int operands = instruction->opcode == OP_NEGATE_NN ? 1 : 2;
+            if (depth < operands) {
+                as->failed = true;
+                return;
+            }
+            for (int k = 1; k <= operands; k++) as->known[depth - k] = true;
+        }
+
+        switch (instruction->opcode) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG: {
+                Value constant = constants[instruction->operand];
+                if (IS_OBJ(constant)) {
+                    // A minor collection can move an object constant, so
+                    // it is read from the pool rather than baked in.
+                    emitImmediate(as, RAX, (uint64_t)(uintptr_t)
+                                               &constants[instruction->operand]);
+                    emitLoad(as, RAX, RAX, 0);
+                } else {
+                    emitImmediate(as, RAX, constant);
+                }
+                emitStore(as, ENTRY_TOP, slotAt(depth), RAX);
+                as->known[depth++] = IS_NUMBER(constant);
+                break;
+            }
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE: {
+                Value value = instruction->opcode == OP_NIL ? NIL_VAL
+                            : instruction->opcode == OP_TRUE ? TRUE_VAL
+                                                             : FALSE_VAL;
+                emitImmediate(as, RAX, value);
+                emitStore(as, ENTRY_TOP, slotAt(depth), RAX);
+                as->known[depth++] = false;
+                break;
+            }
+            case OP_POP: depth--; break;
+            case OP_POPN: depth -= (int)instruction->operand; break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG:
+                emitLoad(as, RAX, STACK_BASE, slotAt(instruction->operand));
+                emitStore(as, ENTRY_TOP, slotAt(depth), RAX);
+                as->known[depth++] = false;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_LONG:
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                emitStore(as, STACK_BASE, slotAt(instruction->operand), RAX);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                emitLoad(as, RAX, GLOBALS, slotAt(instruction->operand));
+                emitImmediate(as, RCX, UNDEFINED_VAL);
+                emitRegisters(as, 0x39, RAX, RCX);
+                emitGuardExit(as, CC_EQUAL, offset, depth);
+                emitStore(as, ENTRY_TOP, slotAt(depth), RAX);
+                as->known[depth++] = false;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+                emitLoad(as, RAX, GLOBALS, slotAt(instruction->operand));
+                emitImmediate(as, RCX, UNDEFINED_VAL);
+                emitRegisters(as, 0x39, RAX, RCX);
+                emitGuardExit(as, CC_EQUAL, offset, depth);
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                if (!as->known[depth - 1]) {
+                    emitObjectGuard(as, RAX, offset, depth);
+                }
+                emitStore(as, GLOBALS, slotAt(instruction->operand), RAX);
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+                emitLoad(as, RDI, ENTRY_TOP, slotAt(depth - 2));
+                emitLoad(as, RSI, ENTRY_TOP, slotAt(depth - 1));
+                emitCall(as, (void*)valuesEqual);
+                if (instruction->opcode == OP_NOT_EQUAL) {
+                    emit(as, 0x34);   // xor al, 1
+                    emit(as, 0x01);
+                }
+                emit(as, 0x0f);
+                emit(as, 0xb6);       // movzx eax, al
+                emit(as, 0xc0);
+                emitImmediate(as, RCX, FALSE_VAL);
+                emitRegisters(as, 0x01, RAX, RCX);
+                emitStore(as, ENTRY_TOP, slotAt(depth - 2), RAX);
+                as->known[--depth - 1] = false;
+                break;
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+            case OP_GREATER_EQUAL_NUM:
+            case OP_LESS_EQUAL_NUM:
+            case OP_GREATER_NN:
+            case OP_LESS_NN:
+            case OP_GREATER_EQUAL_NN:
+            case OP_LESS_EQUAL_NN: {
+                emitCompareOperands(as, offset, depth);
+                int cc = emitCompare(as, instruction->opcode);
+
+                // Branch on the flags when a popping jump takes the result.
+                JitInstruction* next = i + 1 < as->instructionCount
+                                           ? &as->instructions[i + 1] : NULL;
+                bool ifTruthy;
+                if (next != NULL &&
+                    !as->isTarget[next->offset - as->header] &&
+                    isPoppingBranch(next->opcode, &ifTruthy)) {
+                    depth -= 2;
+                    as->native[next->offset - as->header] = as->count;
+                    as->depthAt[next->offset - as->header] = depth + 1;
+                    emitJumpTo(as, ifTruthy ? cc : cc ^ 1, next->target, depth);
+                    i++;
+                    break;
+                }
+
+                emitBoolean(as, cc);
+                emitStore(as, ENTRY_TOP, slotAt(depth - 2), RAX);
+                as->known[--depth - 1] = false;
+                break;
+            }
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_NN:
+                emitArithmetic(as, 0x58, offset, depth--);
+                break;
+            case OP_SUBTRACT:
+            case OP_SUBTRACT_NUM:
+            case OP_SUBTRACT_NN:
+                emitArithmetic(as, 0x5c, offset, depth--);
+                break;
+            case OP_MULTIPLY:
+            case OP_MULTIPLY_NUM:
+            case OP_MULTIPLY_NN:
+                emitArithmetic(as, 0x59, offset, depth--);
+                break;
+            case OP_DIVIDE:
+            case OP_DIVIDE_NUM:
+            case OP_DIVIDE_NN:
+                emitArithmetic(as, 0x5e, offset, depth--);
+                break;
+            case OP_NOT:
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                emitImmediate(as, RCX, NIL_VAL);
+                emitRegisters(as, 0x29, RAX, RCX);
+                emit(as, 0x48);
+                emit(as, 0x83);
+                emit(as, 0xf8);       // cmp rax, 1
+                emit(as, 0x01);
+                emitBoolean(as, CC_BELOW_EQUAL);
+                emitStore(as, ENTRY_TOP, slotAt(depth - 1), RAX);
+                as->known[depth - 1] = false;
+                break;
+            case OP_NEGATE:
+            case OP_NEGATE_NUM:
+            case OP_NEGATE_NN:
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                if (!as->known[depth - 1]) {
+                    emitNumberGuard(as, RAX, offset, depth);
+                }
+                emitImmediate(as, RCX, SIGN_BIT);
+                emitRegisters(as, 0x31, RAX, RCX);
+                emitStore(as, ENTRY_TOP, slotAt(depth - 1), RAX);
+                as->known[depth - 1] = true;
+                break;
+            case OP_PRINT:
+                emitLoad(as, RDI, ENTRY_TOP, slotAt(depth - 1));
+                emitCall(as, (void*)jitPrint);
+                depth--;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                emitJumpTo(as, -1, instruction->target, depth);
+                reachable = false;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                emitTruthJump(as, false, instruction->target, depth);
+                break;
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_TRUE_LONG:
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                emitTruthJump(as, true, instruction->target, depth);
+                break;
+            case OP_FORPREP:
+            case OP_FORLOOP:
+                emitFor(as, instruction, depth);
+                break;
+            default: {
+                bool ifTruthy;
+                if (!isPoppingBranch(instruction->opcode, &ifTruthy)) {
+                    as->failed = true;
+                    return;
+                }
+                emitLoad(as, RAX, ENTRY_TOP, slotAt(depth - 1));
+                depth--;
+                emitTruthJump(as, ifTruthy, instruction->target, depth);
+                break;
+            }
+        }
+    }
+
+    // Falling off the end leaves the loop.
+    if (reachable) {
+        emit(as, 0xe9);
+        addPatch(as, as->end, depth, true);
+    }
+}
+
+// function to emit the prologue that sets up the registers
+static void emitPrologue(Assembler* as) {
+    emit(as, 0x53);                       // push rbx
+    emit(as, 0x41); emit(as, 0x54);       // push r12
+    emit(as, 0x41); emit(as, 0x55);       // push r13
+    emit(as, 0x41); emit(as, 0x56);       // push r14
+    emit(as, 0x41); emit(as, 0x57);       // push r15
+    emitRegisters(as, 0x89, STACK_BASE, RDI);
+    emitRegisters(as, 0x89, GLOBALS, RSI);
+    emitRegisters(as, 0x89, STACK_TOP, RDX);
+    emitLoad(as, ENTRY_TOP, STACK_TOP, 0);
+    emitImmediate(as, QNAN_BITS, QNAN);
+}
+
+/**
+ * function to emit the exits and fill in every jump
+ *
+ * Each exit sets rcx to the stack top and eax to the offset to resume at,
+ * then goes to the shared epilogue.
+ */
+static void emitExits(Assembler* as) {
+    int epilogue = as->count;
+    emitStore(as, STACK_TOP, 0, RCX);
+    emit(as, 0x41); emit(as, 0x5f);       // pop r15
+    emit(as, 0x41); emit(as, 0x5e);       // pop r14
+    emit(as, 0x41); emit(as, 0x5d);       // pop r13
+    emit(as, 0x41); emit(as, 0x5c);       // pop r12
+    emit(as, 0x5b);                       // pop rbx
+    emit(as, 0xc3);                       // ret
+
+    for (int i = 0; i < as->patchCount; i++) {
+        Patch* patch = &as->patches[i];
+        int destination;
+        if (patch->exit) {
+            destination = as->count;
+            emitMemory(as, 0x8d, RCX, ENTRY_TOP, slotAt(patch->depth));
+            emit(as, 0xb8);                   // mov eax, imm32
+            emit32(as, (uint32_t)patch->target);
+            emit(as, 0xe9);
+            emit32(as, (uint32_t)(epilogue - (as->count + 4)));
+        } else {
+            destination = as->native[patch->target - as->header];
+        }
+        // Code may have moved while growing, so write through as->code.
+        int32_t rel = destination - (patch->at + 4);
+        memcpy(&as->code[patch->at], &rel, sizeof(rel));
+    }
+}
+
+/**
+ * function to translate the loop from header to end into machine code
+ *
+ * On success the code is copied to its own mapping, which is made
+ * executable only after it has been written.
+ */
+static void compileLoop(JitLoop* loop, Chunk* chunk, int header, int end) {
+    int length = end - header;
+    Assembler as;
+    as.chunk = chunk;
+    as.header = header;
+    as.end = end;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.instructions = ALLOCATE(JitInstruction, length);
+    as.instructionCount = 0;
+    as.native = ALLOCATE(int, length);
+    as.depthAt = ALLOCATE(int, length);
+    as.isTarget = ALLOCATE(bool, length);
+    as.known = ALLOCATE(bool, length + 1);
+    as.patches = NULL;
+    as.patchCount = 0;
+    as.patchCapacity = 0;
+    as.failed = false;
+    for (int i = 0; i < length; i++) {
+        as.native[i] = -1;
+        as.depthAt[i] = -1;
+        as.isTarget[i] = false;
+    }
+    memset(as.known, 0, sizeof(bool) * (length + 1));
+
+    loop->failed = true;
+    if (decodeLoop(&as)) {
+        emitPrologue(&as);
+        emitLoop(&as);
+        if (!as.failed) emitExits(&as);
+    } else {
+        as.failed = true;
+    }
+
+    if (!as.failed) {
+        void* memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memcpy(memory, as.code, as.count);
+            if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) == 0) {
+                loop->function = (JitFunction)memory;
+                loop->size = as.count;
+                loop->failed = false;
+            } else {
+                munmap(memory, as.count);
+            }
+        }
+    }
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(JitInstruction, as.instructions, length);
+    FREE_ARRAY(int, as.native, length);
+    FREE_ARRAY(int, as.depthAt, length);
+    FREE_ARRAY(bool, as.isTarget, length);
+    FREE_ARRAY(bool, as.known, length + 1);
+    FREE_ARRAY(Patch, as.patches, as.patchCapacity);
+}
+
+/**
+ * function called by run() on every back-edge it takes when vm.jit is set
+ *
+ * header is where the back-edge lands and end is just past it. Counts the
+ * loop, compiles it once it is hot, and runs its machine code if there is
+ * any. Returns the instruction pointer the interpreter continues at.
+ */
+uint8_t* jitLoop(uint8_t* header, uint8_t* end) {
+    Chunk* chunk = vm.chunk;
+    if (jitChunk != chunk) {
+        freeJit();
+        jitChunk = chunk;
+        loopCount = chunk->count;
+        loops = ALLOCATE(JitLoop, loopCount);
+        memset(loops, 0, sizeof(JitLoop) * loopCount);
+    }
+
+    int offset = (int)(header - chunk->code);
+    JitLoop* loop = &loops[offset];
+    if (loop->function == NULL) {
+        if (loop->failed || ++loop->hits < JIT_HOT_LOOP) return header;
+        compileLoop(loop, chunk, offset, (int)(end - chunk->code));
+        if (loop->function == NULL) return header;
+    }
+
+    uint32_t resume = loop->function(vm.stack, vm.globalValues.values,
+                                     &vm.stackTop);
+    return chunk->code + resume;
+}
+
+// function to unmap all machine code and forget the loops of the chunk
+void freeJit() {
+    for (int i = 0; i < loopCount; i++) {
+        if (loops[i].function != NULL) {
+            munmap((void*)loops[i].function, loops[i].size);
+        }
+    }
+    FREE_ARRAY(JitLoop, loops, loopCount);
+    loops = NULL;
+    loopCount = 0;
+    jitChunk = NULL;
+}
+
+#endif
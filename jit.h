@@ -0,0 +1,17 @@
+#ifndef fcc_jit_h
+#define fcc_jit_h
+
+#include "chunk.h"
+
+#ifdef JIT
+
+// Back-edges a loop takes in the interpreter before it is compiled.
+#define JIT_HOT_LOOP 1000
+
+// function declarations for the loop JIT
+uint8_t* jitLoop(uint8_t* header, uint8_t* end);
+void freeJit();
+
+#endif
+
+#endif
@@ -3,10 +3,19 @@
 #include<string.h>
 
 #include "common.h"
+#include "cache.h"
+#include "cgen.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
+// function to print the collector's pause times when fcc exits (--gc-stats)
+static void printStats() {
+    printGcStats(stderr);
+}
+
 // function for repl
 static void repl() {
     char line[1024];
@@ -51,10 +60,53 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+#ifdef BYTECODE_CACHE
+/**
+ * function to run a script through its bytecode cache
+ *
+ * The cache sits next to the script, at its path with CACHE_SUFFIX
+ * appended. One compiled from the same source is mapped and run without
+ * compiling; an older cache is replaced by compiling the script afresh.
+ */
+static InterpretResult runCached(const char* path, const char* source) {
+    uint64_t sourceHash = hashSource(source, strlen(source));
+    size_t length = strlen(path);
+    size_t suffixLength = strlen(CACHE_SUFFIX);
+    char* cachePath = (char*)malloc(length + suffixLength + 1);
+    if (cachePath == NULL) return interpret(source);
+    memcpy(cachePath, path, length);
+    memcpy(cachePath + length, CACHE_SUFFIX, suffixLength + 1);
+
+    InterpretResult result;
+    CachedChunk cached;
+    if(loadCache(cachePath, sourceHash, &cached)) {
+        result = interpretChunk(&cached.chunk);
+        freeCachedChunk(&cached);
+    } else {
+        Chunk chunk;
+        initChunk(&chunk);
+        if(compile(source, &chunk)) {
+            writeCache(cachePath, sourceHash, &chunk);
+            result = interpretChunk(&chunk);
+        } else {
+            result = INTERPRET_COMPILE_ERROR;
+        }
+        freeChunk(&chunk);
+    }
+
+    free(cachePath);
+    return result;
+}
+#endif
+
 // function to run file and interpret
 static void runFile(const char* path) {
     char* source = readFile(path);
+#ifdef BYTECODE_CACHE
+    InterpretResult result = runCached(path, source);
+#else
     InterpretResult result = interpret(source);
+#endif
     free(source);
 
     if(result == INTERPRET_COMPILE_ERROR) exit(65);
@@ -62,16 +114,60 @@ static void runFile(const char* path) {
     
 }
 
+// function to compile a file and write it out as a C program
+static void emitFile(const char* outPath, const char* path) {
+    char* source = readFile(path);
+    Chunk chunk;
+    initChunk(&chunk);
+    if(!compile(source, &chunk)) exit(65);
+
+    FILE* out = fopen(outPath, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+        exit(74);
+    }
+    generateC(&chunk, path, out);
+    fclose(out);
+
+    freeChunk(&chunk);
+    free(source);
+}
+
 int main(int argc, char const *argv[])
 {
     initVM();
 
-    if(argc == 1) {
+    int arg = 1;
+    for(;;) {
+        if(arg < argc && strcmp(argv[arg], "--jit") == 0) {
+#ifdef JIT
+            vm.jit = true;
+#else
+            fprintf(stderr, "--jit is not supported on this platform.\n");
+#endif
+            arg++;
+        } else if(arg + 1 < argc && strcmp(argv[arg], "--gc-pause") == 0) {
+            // Microseconds on the command line, nanoseconds in the VM.
+            vm.gcMaxPause = (uint64_t)(strtod(argv[arg + 1], NULL) * 1000);
+            arg += 2;
+        } else if(arg < argc && strcmp(argv[arg], "--gc-stats") == 0) {
+            atexit(printStats);
+            arg++;
+        } else {
+            break;
+        }
+    }
+
+    if(argc == arg + 3 && strcmp(argv[arg], "--emit-c") == 0) {
+        emitFile(argv[arg + 1], argv[arg + 2]);
+    } else if(argc == arg) {
         repl();
-    } else if(argc == 2) {
-        runFile(argv[1]);
+    } else if(argc == arg + 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: fcc [path]\n");
+        fprintf(stderr, "Usage: fcc [--jit] [--gc-pause us] [--gc-stats] "
+                        "[path]\n"
+                        "       fcc --emit-c out.c path\n");
         exit(64);
     }
 
@@ -1,8 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+static void startCycle();
+static void collectStep(int work);
+
+#ifdef POOL_ALLOC
+/**
+ * Structure of the pools small blocks are served from
+ *
+ * free "first free block of each size class; each free block holds the
+ *       next one in its first word"
+ * slabTop "where the next new block is carved from the current slab"
+ * slabEnd "end of the current slab"
+ * slabs "every slab, linked through their first word"
+ */
+typedef struct {
+    void* free[POOL_CLASSES];
+    uint8_t* slabTop;
+    uint8_t* slabEnd;
+    void* slabs;
+} Pools;
+
+static Pools pools;
+
+// function to get the size class of a block of 1 to POOL_MAX_SIZE bytes
+static inline int sizeClass(size_t size) {
+    return (int)((size - 1) / POOL_GRAIN);
+}
+
+// function to take a block of a size class from its free list, or carve a
+// new one from the current slab
+static void* poolAllocate(int sizeClass) {
+    void* block = pools.free[sizeClass];
+    if (block != NULL) {
+        pools.free[sizeClass] = *(void**)block;
+        return block;
+    }
+
+    size_t size = (size_t)(sizeClass + 1) * POOL_GRAIN;
+    if (size > (size_t)(pools.slabEnd - pools.slabTop)) {
+        // The rest of the old slab is too small, and is left unused.
+        uint8_t* slab = (uint8_t*)malloc(POOL_SLAB_SIZE);
+        if (slab == NULL) exit(1);
+        *(void**)slab = pools.slabs;
+        pools.slabs = slab;
+        pools.slabTop = slab + POOL_GRAIN;
+        pools.slabEnd = slab + POOL_SLAB_SIZE;
+    }
+    block = pools.slabTop;
+    pools.slabTop += size;
+    return block;
+}
+
+// function to put a block back on the free list of its size class
+static void poolFree(void* block, int sizeClass) {
+    *(void**)block = pools.free[sizeClass];
+    pools.free[sizeClass] = block;
+}
+
+/**
+ * function to resize a block as realloc() would, given the size it had
+ *
+ * The sizes say where a block lives: a pool for up to POOL_MAX_SIZE
+ * bytes, malloc() above that. A block that keeps its size class is left
+ * where it is. Any other is copied to its new home.
+ */
+static void* resizeBlock(void* pointer, size_t oldSize, size_t newSize) {
+    if (oldSize > POOL_MAX_SIZE && newSize > POOL_MAX_SIZE) {
+        void* result = realloc(pointer, newSize);
+        if (result == NULL) exit(1);
+        return result;
+    }
+    if (pointer != NULL && oldSize <= POOL_MAX_SIZE && newSize > 0 &&
+        newSize <= POOL_MAX_SIZE && sizeClass(oldSize) == sizeClass(newSize)) {
+        return pointer;
+    }
+
+    void* result = NULL;
+    if (newSize > POOL_MAX_SIZE) {
+        result = malloc(newSize);
+        if (result == NULL) exit(1);
+    } else if (newSize > 0) {
+        result = poolAllocate(sizeClass(newSize));
+    }
+
+    if (pointer != NULL) {
+        if (result != NULL) {
+            memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        }
+        if (oldSize > POOL_MAX_SIZE) {
+            free(pointer);
+        } else {
+            poolFree(pointer, sizeClass(oldSize));
+        }
+    }
+    return result;
+}
+#else
+// function to resize a block with the system allocator
+static void* resizeBlock(void* pointer, size_t oldSize, size_t newSize) {
+    (void)oldSize;
+    if(newSize == 0) {
+        free(pointer);
+        return NULL;
+    }
+
+    void* result = realloc(pointer, newSize);
+    if(result == NULL) exit(1);
+    return result;
+}
+#endif
 
 /**
  * Function to reallocate pointer size
@@ -13,26 +128,361 @@
  * 
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    if(newSize == 0) {
-        free(pointer);
-        return NULL;
+    vm.bytesAllocated += newSize;
+    vm.bytesAllocated -= oldSize;
+    // Going past vm.nextStep is acted on at the next object allocation (see
+    // allocateObject()); only there may young objects move.
+#ifdef DEBUG_STRESS_GC
+    if (newSize > oldSize) {
+        if (vm.gcPhase == GC_IDLE) startCycle();
+        collectStep(GC_STRESS_WORK);
     }
+#endif
 
-    void* result = realloc(pointer, newSize);
-    if(result == NULL) exit(1);
-    return result;
+    return resizeBlock(pointer, oldSize, newSize);
+}
+
+// function to check whether an object is in the nursery
+static inline bool isYoung(Obj* object) {
+    return (uint8_t*)object >= vm.nursery && (uint8_t*)object < vm.nurseryEnd;
+}
+
+// function to mark an object reachable and queue it to have its references traced
+void markObject(Obj* object) {
+    // Young objects are only ever freed by collectYoung(), so the major
+    // collector leaves them white; they are promoted marked instead.
+    if (object == NULL || object->isMarked || isYoung(object)) return;
+    object->isMarked = true;
+
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        // Not reallocate(): growing the gray stack must not start a collection.
+        Obj** grayStack = (Obj**)realloc(vm.grayStack,
+                                         sizeof(Obj*) * vm.grayCapacity);
+        if (grayStack == NULL) exit(1);
+        vm.grayStack = grayStack;
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+// function to mark a value reachable if it is an object
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
-// function to object based on type
+// function to mark the objects a gray object refers to
+static void blackenObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            // Strings refer to no other objects.
+            break;
+    }
+}
+
+// function to get the size of an object, as allocated
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    }
+    return sizeof(Obj);
+}
+
+// function to free an old object; a string's characters go with it
 static void freeObject(Obj* object) {
-  switch (object->type) {
-    case OBJ_STRING: {
-      ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
-      break;
+  reallocate(object, objectSize(object), 0);
+}
+
+// function to read the monotonic clock for pause times, in nanoseconds;
+// wall-clock time can jump while a step runs and skew its pause
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// function to count a pause in the histogram of its power of two in microseconds
+static void recordPause(uint64_t pause) {
+    uint64_t micros = pause / 1000;
+    int bucket = 0;
+    while (micros > 0 && bucket < GC_PAUSE_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
     }
-  }
+    vm.gcStats.pauses[bucket]++;
+    vm.gcStats.pauseCount++;
+    vm.gcStats.totalPause += pause;
+    if (pause > vm.gcStats.maxPause) vm.gcStats.maxPause = pause;
+}
+
+// function to start a major cycle: its marking starts with no object marked
+static void startCycle() {
+    vm.gcPhase = GC_MARK;
+    vm.gcCursor = 0;
+}
+
+/**
+ * function to mark the next root of the marking phase, false once all are
+ *
+ * The global slots, the global names and the constants of vm.chunk are
+ * marked a few at a time. Entries added to them later go through
+ * writeBarrier(). Growing one of them while this runs only makes the
+ * cursor see a root twice, never skip one. The keys of vm.globals are the
+ * names in vm.globalNames. The stack and the compiler's consts change too
+ * often for a barrier, so finishMarking() marks them in one go.
+ */
+static bool markNextRoot() {
+    int index = vm.gcCursor;
+    if (index < vm.globalValues.count) {
+        markValue(vm.globalValues.values[index]);
+    } else if ((index -= vm.globalValues.count) < vm.globalNames.count) {
+        markValue(vm.globalNames.values[index]);
+    } else if (vm.chunk != NULL &&
+               (index -= vm.globalNames.count) < vm.chunk->constants.count) {
+        markValue(vm.chunk->constants.values[index]);
+    } else {
+        return false;
+    }
+    vm.gcCursor++;
+    return true;
+}
+
+// function to end the marking phase: the only part that is not incremental
+static void finishMarking() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+    markCompilerRoots();
+    while (vm.grayCount > 0) {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+
+    vm.gcPhase = GC_SWEEP_STRINGS;
+    vm.gcCursor = 0;
+    vm.gcSweepCapacity = vm.strings.capacity;
+}
+
+/**
+ * function to delete the next interned string that was not marked
+ *
+ * vm.strings is weak: an old string only it refers to is deleted here and
+ * freed by the sweep. Young strings are left to collectYoung(). If the
+ * table was resized since the last entry, the walk starts over, since the
+ * entries have moved.
+ */
+static bool sweepNextString() {
+    if (vm.strings.capacity != vm.gcSweepCapacity) {
+        vm.gcCursor = 0;
+        vm.gcSweepCapacity = vm.strings.capacity;
+    }
+    if (vm.gcCursor >= vm.strings.capacity) return false;
+
+    Entry* entry = &vm.strings.entries[vm.gcCursor++];
+    ObjString* key = entry->key;
+    if (key != NULL && !isYoung(&key->obj) && !key->obj.isMarked) {
+        tableDelete(&vm.strings, key);
+    }
+    return true;
+}
+
+/**
+ * function to free the next old object if it was not marked, or unmark it
+ *
+ * vm.sweepLink points to the link to the next object to look at, so an
+ * object can be unlinked without knowing the one before it.
+ */
+static bool sweepNextObject() {
+    Obj* object = *vm.sweepLink;
+    if (object == NULL) return false;
+
+    if (object->isMarked) {
+        object->isMarked = false;
+        vm.sweepLink = &object->next;
+    } else {
+        *vm.sweepLink = object->next;
+        freeObject(object);
+    }
+    return true;
+}
+
+/**
+ * function to do up to a number of units of major collection work
+ *
+ * A unit is one root, gray object, intern table entry or old object. The
+ * phases run in order: marking (incremental), finishing the mark (one
+ * go), deleting unmarked strings from vm.strings, sweeping vm.objects.
+ */
+static void collectStep(int work) {
+    while (work > 0) {
+        switch (vm.gcPhase) {
+            case GC_IDLE:
+                return;
+            case GC_MARK:
+                if (vm.grayCount > 0) {
+                    blackenObject(vm.grayStack[--vm.grayCount]);
+                } else if (!markNextRoot()) {
+                    finishMarking();
+                }
+                break;
+            case GC_SWEEP_STRINGS:
+                if (!sweepNextString()) {
+                    vm.gcPhase = GC_SWEEP;
+                    vm.sweepLink = &vm.objects;
+                }
+                break;
+            case GC_SWEEP:
+                if (!sweepNextObject()) {
+                    vm.gcPhase = GC_IDLE;
+                    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+                    if (vm.nextGC < GC_HEAP_MIN) vm.nextGC = GC_HEAP_MIN;
+                }
+                break;
+        }
+        work--;
+    }
+}
+
+/**
+ * function to run the major collector for one pause, started at start
+ *
+ * Works through GC_STEP_WORK units, in batches so the clock is not read
+ * for every one, and stops early once the pause reaches vm.gcMaxPause.
+ */
+static void collectIncrement(uint64_t start) {
+    if (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) startCycle();
+
+    for (int work = 0; work < GC_STEP_WORK && vm.gcPhase != GC_IDLE;
+         work += GC_STEP_BATCH) {
+        collectStep(GC_STEP_BATCH);
+        if (vm.gcMaxPause != 0 && nanoseconds() - start >= vm.gcMaxPause) {
+            break;
+        }
+    }
+}
+
+// function to print the pause time histogram of the collector
+void printGcStats(FILE* out) {
+    fprintf(out, "gc: %llu pauses, %.1f ms total, max %.1f us\n",
+            (unsigned long long)vm.gcStats.pauseCount,
+            vm.gcStats.totalPause / 1e6, vm.gcStats.maxPause / 1e3);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (vm.gcStats.pauses[i] == 0) continue;
+        unsigned long low = i == 0 ? 0 : 1ul << (i - 1);
+        fprintf(out, "  %8lu us .. %8lu us  %llu\n", low, 1ul << i,
+                (unsigned long long)vm.gcStats.pauses[i]);
+    }
+}
+
+// function to add a new object to the old generation
+static void linkOld(Obj* object) {
+    // Marked while a major cycle has yet to sweep, since no root is rescanned
+    // for it. Strings have no references, so it need not be traced either.
+    object->isMarked = vm.gcPhase == GC_MARK ||
+                       vm.gcPhase == GC_SWEEP_STRINGS;
+    object->next = vm.objects;
+    vm.objects = object;
+    // A sweep that has not left the head of the list must not see it.
+    if (vm.gcPhase == GC_SWEEP && vm.sweepLink == &vm.objects) {
+        vm.sweepLink = &object->next;
+    }
+}
+
+// function to allocate an object too big for the nursery in the old generation
+Obj* allocateOldObject(size_t size) {
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    linkOld(object);
+    return object;
+}
+
+/**
+ * function to copy a nursery object into the old generation
+ *
+ * The copy is linked onto vm.objects, and the nursery object's next field,
+ * unused while it is young, is left pointing to it, so every later
+ * reference to the same object gets the same copy. The memory is taken
+ * without reallocate(), so that no collection starts halfway through a
+ * minor one, but from the same place, so freeObject() can give it back.
+ */
+static Obj* promote(Obj* object) {
+    if (object->next != NULL) return object->next;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)resizeBlock(NULL, 0, size);
+    vm.bytesAllocated += size;
+    memcpy(copy, object, size);
+    linkOld(copy);
+
+    object->next = copy;
+    return copy;
+}
+
+// function to promote the nursery object a value refers to and update it
+bool forwardValue(Value* value) {
+    if (!IS_OBJ(*value) || !isYoung(AS_OBJ(*value))) return false;
+    *value = OBJ_VAL(promote(AS_OBJ(*value)));
+    return true;
+}
+
+// function to update every value of an array, true if any of them moved
+static bool forwardArray(ValueArray* array) {
+    bool moved = false;
+    for (int i = 0; i < array->count; i++) {
+        moved = forwardValue(&array->values[i]) || moved;
+    }
+    return moved;
+}
+
+/**
+ * function to empty the nursery: a minor collection
+ *
+ * Runs when a new object does not fit in the nursery or the heap has
+ * grown past vm.nextStep, and then gives the major collector its turn
+ * (collectIncrement()) in the same pause. Every young object
+ * a root refers to is promoted, and the rest are dead. Strings hold no
+ * references, so the only references into the nursery are in the roots,
+ * and those are scanned in full: the stack, the global slots, the
+ * constants and the compiler's consts. The tables are not scanned.
+ * Walking the nursery instead, which costs as much as the allocation did,
+ * moves each surviving key in vm.strings and vm.globals to its copy and
+ * deletes each dead string from vm.strings.
+ *
+ * Objects move here, and only here: nothing may keep a pointer to a young
+ * object across a call that allocates one, other than in a root.
+ */
+void collectYoung() {
+    uint64_t start = nanoseconds();
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+    forwardArray(&vm.globalValues);
+    forwardArray(&vm.globalNames);
+    if (vm.chunk != NULL && forwardArray(&vm.chunk->constants)) {
+        // The constant index is keyed on the objects' addresses.
+        rehashConstants(vm.chunk);
+    }
+    forwardCompilerRoots();
+
+    uint8_t* top = vm.nurseryTop;
+    for (uint8_t* bytes = vm.nursery; bytes < top;) {
+        Obj* object = (Obj*)bytes;
+        bytes += NURSERY_ALIGN(objectSize(object));
+        if (object->type == OBJ_STRING) {
+            ObjString* string = (ObjString*)object;
+            if (object->next != NULL) {
+                ObjString* copy = (ObjString*)object->next;
+                tableReplaceKey(&vm.strings, string, copy);
+                tableReplaceKey(&vm.globals, string, copy);
+            } else {
+                tableDelete(&vm.strings, string);
+            }
+        }
+    }
+    vm.nurseryTop = vm.nursery;
+
+    collectIncrement(start);
+    vm.nextStep = vm.gcPhase == GC_IDLE ? vm.nextGC
+                                        : vm.bytesAllocated + GC_STEP_BYTES;
+    recordPause(nanoseconds() - start);
 }
 
 // function to free objects
@@ -43,5 +493,21 @@ void freeObjects() {
     freeObject(object);
     object = next;
   }
+
+  // Young objects own nothing outside the nursery.
+  FREE_ARRAY(uint8_t, vm.nursery, NURSERY_SIZE);
+
+  free(vm.grayStack);
 }
 
+// function to free the pool slabs, once every block taken from them is back
+void freePools() {
+#ifdef POOL_ALLOC
+    while (pools.slabs != NULL) {
+        void* next = *(void**)pools.slabs;
+        free(pools.slabs);
+        pools.slabs = next;
+    }
+    memset(&pools, 0, sizeof(pools));
+#endif
+}
@@ -1,6 +1,8 @@
 #ifndef fcc_memory_h
 #define fcc_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
@@ -17,10 +19,49 @@
     (type*)reallocate(pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))  
 
+// Heap size to collect at next, as a multiple of what survived the last
+// collection, and the least it is ever set to.
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_MIN (1024 * 1024)
+
+// While a major cycle is under way, the collector runs for up to
+// GC_STEP_WORK units every GC_STEP_BYTES allocated, reading the clock
+// every GC_STEP_BATCH units. DEBUG_STRESS_GC also does GC_STRESS_WORK
+// units on every allocation that grows memory.
+#define GC_STEP_BYTES (64 * 1024)
+#define GC_STEP_WORK 16384
+#define GC_STEP_BATCH 256
+#define GC_STRESS_WORK 4
+
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)          
 
+// Size of the nursery new objects are bump-allocated in, and the
+// alignment of each object in it.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Largest object allocated in the nursery. A bigger one, such as a long
+// string, is allocated in the old generation, so it is never copied.
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+
+// Blocks of up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+// POOL_GRAIN and served from a free list per size, refilled from slabs of
+// POOL_SLAB_SIZE bytes. Bigger blocks go to malloc().
+#define POOL_GRAIN 8
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRAIN)
+#define POOL_SLAB_SIZE (64 * 1024)
+
 // function declaration for memory functions
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void markObject(Obj* object);
+void markValue(Value value);
+Obj* allocateOldObject(size_t size);
+bool forwardValue(Value* value);
+void collectYoung();
+void printGcStats(FILE* out);
+void freeObjects();
+void freePools();
 
 #endif
\ No newline at end of file
@@ -8,27 +8,55 @@
 #include "vm.h"
 
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*) allocateObject(sizeof(type), objectType)
-
-
-// function to allocate object
+/**
+ * function to allocate object
+ *
+ * New objects are bumped off the nursery. When it is full, or the heap
+ * has grown past vm.nextStep, collectYoung() empties it first, which can
+ * move every other young object. An object is only linked onto
+ * vm.objects once it is promoted. One bigger than NURSERY_MAX_OBJECT
+ * goes straight to the old generation instead.
+ */
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
+    size_t aligned = NURSERY_ALIGN(size);
+#ifdef DEBUG_STRESS_GC
+    collectYoung();
+#endif
+    if ((size <= NURSERY_MAX_OBJECT &&
+         aligned > (size_t)(vm.nurseryEnd - vm.nurseryTop)) ||
+        vm.bytesAllocated > vm.nextStep) {
+        collectYoung();
+    }
 
-    object->next = vm.objects;
-    vm.objects = object;
+    Obj* object;
+    if (size > NURSERY_MAX_OBJECT) {
+        object = allocateOldObject(size);
+    } else {
+        object = (Obj*)vm.nurseryTop;
+        vm.nurseryTop += aligned;
+        object->isMarked = false;
+        object->next = NULL;
+    }
+    object->type = type;
     return object;
 }
 
-// function to allocate string
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// function to allocate a string of a length, for the caller to fill in
+static ObjString* allocateString(int length) {
+    ObjString* string = (ObjString*)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// function to add a filled in string to the intern table
+static ObjString* internString(ObjString* string, uint32_t hash) {
     string->hash = hash;
+    // Growing the intern table can collect; keep the new string reachable.
+    push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
+    pop();
     return string;
 }
 
@@ -44,28 +72,60 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-// function to take string and allocate it
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+/**
+ * function to look up an interned string
+ *
+ * vm.strings is weak: once marking is over, an old string nothing refers
+ * to is deleted from it and freed. One found before that happens is in use
+ * again, so it is marked here; strings refer to nothing, so it needs no
+ * tracing.
+ */
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    if (interned != NULL && vm.gcPhase == GC_SWEEP_STRINGS) {
+        interned->obj.isMarked = true;
     }
-    return allocateString(chars, length, hash);
+    return interned;
 }
 
 // function to copy string to heap
 ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
+}
+
+/**
+ * function to concatenate the two strings on top of the VM stack
+ *
+ * The characters are copied straight into the new string, which is then
+ * looked up. If an equal string is interned already, that one is returned,
+ * and the new one, still the last object in the nursery, is handed back.
+ * The operands are left on the stack for the caller to pop: allocating
+ * can move them, so they are read from there afterwards.
+ */
+ObjString* concatenateStrings() {
+    int length = AS_STRING(vm.stackTop[-2])->length +
+                 AS_STRING(vm.stackTop[-1])->length;
+    ObjString* string = allocateString(length);
+    ObjString* a = AS_STRING(vm.stackTop[-2]);
+    ObjString* b = AS_STRING(vm.stackTop[-1]);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+
+    uint32_t hash = hashString(string->chars, length);
+    ObjString* interned = findInterned(string->chars, length, hash);
+    if (interned == NULL) return internString(string, hash);
+
+    // A big one is in the old generation, and is left to the collector.
+    if (sizeof(ObjString) + length + 1 <= NURSERY_MAX_OBJECT) {
+        vm.nurseryTop = (uint8_t*)string;
+    }
+    return interned;
 }
 
 // function to print object
@@ -18,19 +18,22 @@ typedef enum {
 
 struct Obj {
     ObjType type;
+    bool isMarked;
     struct Obj* next;
 };
 
+// The characters follow the header in the same allocation, with a '\0'
+// after the last one.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
 
-ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* concatenateStrings();
 void printObject(Value value);
 
 // function to check object type
@@ -0,0 +1,490 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+/**
+ * Structure of one decoded instruction
+ *
+ * opcode "the instruction; jumps are kept as OP_JUMP, OP_JUMP_IF_FALSE,
+ *         OP_JUMP_IF_TRUE, OP_POP_JUMP_IF_FALSE or OP_POP_JUMP_IF_TRUE and
+ *         get their final form and direction when re-encoded"
+ * operand "constant index, slot or pop count, the four operand bytes of
+ *          OP_FORPREP and OP_FORLOOP, unused for other jumps"
+ * line "source line of the instruction"
+ * testLine "source line of the limit test of OP_FORPREP and OP_FORLOOP,
+ *           which their jump bytes carry"
+ * target "index of the instruction a jump lands on, -1 for other instructions"
+ * offset "offset of the instruction in the rewritten chunk"
+ * wide "the jump needs its *_LONG form"
+ * isTarget "some jump lands on this instruction"
+ * deleted "the instruction was merged into its neighbour"
+ */
+typedef struct {
+    uint8_t opcode;
+    uint32_t operand;
+    int line;
+    int testLine;
+    int target;
+    int offset;
+    bool wide;
+    bool isTarget;
+    bool deleted;
+} Instruction;
+
+/**
+ * Structure of a chunk while it is being rewritten
+ *
+ * code "decoded instructions in program order"
+ * count "number of decoded instructions"
+ * capacity "number of instructions allocated"
+ */
+typedef struct {
+    Instruction* code;
+    int count;
+    int capacity;
+} Program;
+
+// function to check whether an instruction is a jump
+static bool isJump(Instruction* instruction) {
+    return instruction->target != -1;
+}
+
+// function to check for OP_FORPREP and OP_FORLOOP, which have no long form
+static bool isForInstruction(Instruction* instruction) {
+    return instruction->opcode == OP_FORPREP ||
+           instruction->opcode == OP_FORLOOP;
+}
+
+// function to get the number of operand bytes an instruction is written with
+static int operandBytes(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_POPN:
+            return 1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_POP_LOOP_IF_TRUE:
+        case OP_POP_LOOP_IF_FALSE:
+            return 2;
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_TRUE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_LOOP_IF_TRUE_LONG:
+        case OP_POP_LOOP_IF_FALSE_LONG:
+            return 3;
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            return 6;
+        default:
+            return 0;
+    }
+}
+
+// function to read a big-endian operand of the given width
+static uint32_t readOperand(uint8_t* bytes, int width) {
+    uint32_t operand = 0;
+    for (int i = 0; i < width; i++) operand = (operand << 8) | bytes[i];
+    return operand;
+}
+
+/**
+ * function to decode a chunk into a Program
+ *
+ * Jump operands are turned into the index of the instruction they land on,
+ * so instructions can be merged and removed without breaking them.
+ */
+static void decodeChunk(Chunk* chunk, Program* program) {
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    int* destinations = ALLOCATE(int, chunk->count);
+    program->code = ALLOCATE(Instruction, chunk->count);
+    program->count = 0;
+    program->capacity = chunk->count;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t opcode = chunk->code[offset];
+        int width = operandBytes(opcode);
+        int next = offset + 1 + width;
+        int operand = 0;
+        if (opcode == OP_FORPREP || opcode == OP_FORLOOP) {
+            // Four operand bytes, then the 16-bit jump.
+            operand = (int)readOperand(&chunk->code[offset + 5], 2);
+        } else {
+            operand = (int)readOperand(&chunk->code[offset + 1], width);
+        }
+
+        Instruction* instruction = &program->code[program->count];
+        instruction->opcode = opcode;
+        instruction->operand = (uint32_t)operand;
+        instruction->line = getLine(chunk, offset);
+        instruction->testLine = getLine(chunk, next - 1);
+        instruction->target = -1;
+        instruction->wide = false;
+        instruction->isTarget = false;
+        instruction->deleted = false;
+
+        int destination = -1;
+        switch (opcode) {
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+                instruction->opcode = OP_JUMP;
+                destination = next + operand;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                instruction->opcode = OP_JUMP_IF_FALSE;
+                destination = next + operand;
+                break;
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_TRUE_LONG:
+                instruction->opcode = OP_JUMP_IF_TRUE;
+                destination = next + operand;
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE_LONG:
+                instruction->opcode = OP_POP_JUMP_IF_FALSE;
+                destination = next + operand;
+                break;
+            case OP_POP_JUMP_IF_TRUE:
+            case OP_POP_JUMP_IF_TRUE_LONG:
+                instruction->opcode = OP_POP_JUMP_IF_TRUE;
+                destination = next + operand;
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                instruction->opcode = OP_JUMP;
+                destination = next - operand;
+                break;
+            case OP_POP_LOOP_IF_TRUE:
+            case OP_POP_LOOP_IF_TRUE_LONG:
+                instruction->opcode = OP_POP_JUMP_IF_TRUE;
+                destination = next - operand;
+                break;
+            case OP_POP_LOOP_IF_FALSE:
+            case OP_POP_LOOP_IF_FALSE_LONG:
+                instruction->opcode = OP_POP_JUMP_IF_FALSE;
+                destination = next - operand;
+                break;
+            case OP_FORPREP:
+                instruction->operand = readOperand(&chunk->code[offset + 1], 4);
+                destination = next + operand;
+                break;
+            case OP_FORLOOP:
+                instruction->operand = readOperand(&chunk->code[offset + 1], 4);
+                destination = next - operand;
+                break;
+            default:
+                break;
+        }
+
+        destinations[program->count] = destination;
+        indexAt[offset] = program->count++;
+        offset = next;
+    }
+    indexAt[chunk->count] = program->count;
+
+    for (int i = 0; i < program->count; i++) {
+        if (destinations[i] == -1) continue;
+        int target = indexAt[destinations[i]];
+        program->code[i].target = target;
+        if (target < program->count) program->code[target].isTarget = true;
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+    FREE_ARRAY(int, destinations, chunk->count);
+}
+
+// function to get the first instruction at or after index that was not deleted
+static int liveFrom(Program* program, int index) {
+    while (index < program->count && program->code[index].deleted) index++;
+    return index;
+}
+
+// function to get the instruction at index, or NULL past the end
+static Instruction* at(Program* program, int index) {
+    return index < program->count ? &program->code[index] : NULL;
+}
+
+// function to check the opcode of the instruction at index
+static bool opcodeAt(Program* program, int index, uint8_t opcode) {
+    Instruction* instruction = at(program, index);
+    return instruction != NULL && instruction->opcode == opcode;
+}
+
+// function to check whether a jump pops the condition it tests
+static bool popsCondition(Instruction* jump) {
+    return jump->opcode == OP_POP_JUMP_IF_FALSE ||
+           jump->opcode == OP_POP_JUMP_IF_TRUE;
+}
+
+/**
+ * function to drop an OP_NOT in front of a popping conditional jump
+ *
+ * OP_NOT, OP_POP_JUMP_IF_FALSE becomes OP_POP_JUMP_IF_TRUE and the other
+ * way round. The jumps that leave the condition on the stack are left
+ * alone, since the value left there would change.
+ */
+static void invertNegatedJumps(Program* program) {
+    for (int i = 0; i < program->count; i++) {
+        if (!opcodeAt(program, i, OP_NOT)) continue;
+
+        Instruction* jump = at(program, i + 1);
+        if (jump == NULL || jump->isTarget || !popsCondition(jump)) continue;
+
+        jump->opcode = jump->opcode == OP_POP_JUMP_IF_FALSE
+                           ? OP_POP_JUMP_IF_TRUE
+                           : OP_POP_JUMP_IF_FALSE;
+        program->code[i].deleted = true;
+    }
+}
+
+// function to merge a comparison and the OP_NOT after it
+static void fuseNegatedComparisons(Program* program) {
+    for (int i = 0; i + 1 < program->count; i++) {
+        Instruction* compare = &program->code[i];
+        Instruction* negate = &program->code[i + 1];
+        if (compare->deleted || negate->deleted ||
+            negate->opcode != OP_NOT || negate->isTarget) {
+            continue;
+        }
+
+        switch (compare->opcode) {
+            case OP_EQUAL:   compare->opcode = OP_NOT_EQUAL; break;
+            case OP_GREATER: compare->opcode = OP_LESS_EQUAL; break;
+            case OP_LESS:    compare->opcode = OP_GREATER_EQUAL; break;
+            case OP_GREATER_NN: compare->opcode = OP_LESS_EQUAL_NN; break;
+            case OP_LESS_NN:    compare->opcode = OP_GREATER_EQUAL_NN; break;
+            default: continue;
+        }
+        negate->deleted = true;
+    }
+}
+
+// function to merge runs of OP_POP into OP_POPN
+static void mergePops(Program* program) {
+    for (int i = 0; i < program->count; i++) {
+        Instruction* first = &program->code[i];
+        if (first->opcode != OP_POP) continue;
+
+        int count = 1;
+        while (count < UINT8_MAX && opcodeAt(program, i + count, OP_POP) &&
+               !program->code[i + count].isTarget) {
+            program->code[i + count].deleted = true;
+            count++;
+        }
+
+        if (count > 1) {
+            first->opcode = OP_POPN;
+            first->operand = count;
+        }
+        i += count - 1;
+    }
+}
+
+/**
+ * function to point jumps that land on another jump at its destination
+ *
+ * Every jump can follow an OP_JUMP it lands on. A jump that leaves its
+ * condition on the stack and lands on another such jump testing the same
+ * value either follows it or skips past it. Those jumps only go forward,
+ * so they are not threaded into a backward jump.
+ */
+static void threadJumps(Program* program) {
+    for (int i = 0; i < program->count; i++) {
+        Instruction* jump = &program->code[i];
+        if (jump->deleted || !isJump(jump) || isForInstruction(jump)) continue;
+
+        bool forwardOnly = jump->opcode == OP_JUMP_IF_FALSE ||
+                           jump->opcode == OP_JUMP_IF_TRUE;
+        jump->target = liveFrom(program, jump->target);
+        for (int steps = 0; steps < program->count; steps++) {
+            Instruction* next = at(program, jump->target);
+            if (next == NULL || next == jump || !isJump(next)) break;
+            // A counted loop's entry test must run, so it is never skipped.
+            if (isForInstruction(next)) break;
+
+            int target;
+            if (next->opcode == OP_JUMP ||
+                (forwardOnly && next->opcode == jump->opcode)) {
+                target = liveFrom(program, next->target);
+            } else if (forwardOnly && (next->opcode == OP_JUMP_IF_FALSE ||
+                                       next->opcode == OP_JUMP_IF_TRUE)) {
+                target = liveFrom(program, jump->target + 1);
+            } else {
+                break;
+            }
+
+            if (forwardOnly && target <= i) break;
+            jump->target = target;
+        }
+    }
+}
+
+// function to get the size of an instruction in the rewritten chunk
+static int encodedLength(Instruction* instruction) {
+    if (isForInstruction(instruction)) return 7;
+    if (isJump(instruction)) return instruction->wide ? 4 : 3;
+    return 1 + operandBytes(instruction->opcode);
+}
+
+// function to get the distance a jump covers in the rewritten chunk
+static int jumpDistance(Program* program, Instruction* jump) {
+    int next = jump->offset + encodedLength(jump);
+    int destination = jump->target < program->count
+                          ? program->code[jump->target].offset
+                          : program->code[program->count - 1].offset +
+                                encodedLength(&program->code[program->count - 1]);
+    return destination >= next ? destination - next : next - destination;
+}
+
+/**
+ * function to assign offsets to the rewritten instructions
+ *
+ * Every jump starts in its short form. A jump that does not fit is widened
+ * and the offsets recomputed, until nothing changes. Widening only moves
+ * code further apart, so this always settles. Returns the new size, or -1
+ * if an OP_FORPREP or OP_FORLOOP, which cannot be widened, no longer fits.
+ */
+static int layoutProgram(Program* program) {
+    for (;;) {
+        int offset = 0;
+        for (int i = 0; i < program->count; i++) {
+            Instruction* instruction = &program->code[i];
+            instruction->offset = offset;
+            if (!instruction->deleted) offset += encodedLength(instruction);
+        }
+
+        bool changed = false;
+        for (int i = 0; i < program->count; i++) {
+            Instruction* jump = &program->code[i];
+            if (jump->deleted || !isJump(jump) || jump->wide) continue;
+            if (jumpDistance(program, jump) > UINT16_MAX) {
+                if (isForInstruction(jump)) return -1;
+                jump->wide = true;
+                changed = true;
+            }
+        }
+
+        if (!changed) return offset;
+    }
+}
+
+// function to get the opcode a jump is written with
+static uint8_t jumpOpcode(Instruction* jump, bool backward) {
+    switch (jump->opcode) {
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            return jump->opcode;
+        case OP_JUMP:
+            if (backward) return jump->wide ? OP_LOOP_LONG : OP_LOOP;
+            return jump->wide ? OP_JUMP_LONG : OP_JUMP;
+        case OP_JUMP_IF_FALSE:
+            return jump->wide ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_FALSE;
+        case OP_JUMP_IF_TRUE:
+            return jump->wide ? OP_JUMP_IF_TRUE_LONG : OP_JUMP_IF_TRUE;
+        case OP_POP_JUMP_IF_FALSE:
+            if (backward) {
+                return jump->wide ? OP_POP_LOOP_IF_FALSE_LONG
+                                  : OP_POP_LOOP_IF_FALSE;
+            }
+            return jump->wide ? OP_POP_JUMP_IF_FALSE_LONG : OP_POP_JUMP_IF_FALSE;
+        default:
+            if (backward) {
+                return jump->wide ? OP_POP_LOOP_IF_TRUE_LONG
+                                  : OP_POP_LOOP_IF_TRUE;
+            }
+            return jump->wide ? OP_POP_JUMP_IF_TRUE_LONG : OP_POP_JUMP_IF_TRUE;
+    }
+}
+
+// function to write the rewritten instructions back into the chunk
+static void encodeProgram(Program* program, Chunk* chunk, int size) {
+    uint8_t* code = ALLOCATE(uint8_t, size);
+    chunk->lineCount = 0;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->deleted) continue;
+
+        int offset = instruction->offset;
+        int length = encodedLength(instruction);
+        uint32_t operand = instruction->operand;
+        uint8_t opcode = instruction->opcode;
+        if (isJump(instruction)) {
+            instruction->target = liveFrom(program, instruction->target);
+            bool backward = instruction->target <= i;
+            opcode = jumpOpcode(instruction, backward);
+            operand = (uint32_t)jumpDistance(program, instruction);
+        }
+
+        code[offset] = opcode;
+        for (int byte = length - 1; byte > 0; byte--) {
+            code[offset + byte] = operand & 0xff;
+            operand >>= 8;
+        }
+        if (isForInstruction(instruction)) {
+            // The jump filled the last two bytes; the rest are operands.
+            operand = instruction->operand;
+            for (int byte = 4; byte > 0; byte--) {
+                code[offset + byte] = operand & 0xff;
+                operand >>= 8;
+            }
+        }
+        addLine(chunk, offset, instruction->line);
+        if (isForInstruction(instruction)) {
+            addLine(chunk, offset + length - 2, instruction->testLine);
+        }
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    chunk->code = code;
+    chunk->count = size;
+    chunk->capacity = size;
+}
+
+/**
+ * function to run the peephole optimizer over a finished chunk
+ *
+ * Rewrites the instruction patterns the single-pass compiler leaves behind:
+ * a comparison followed by OP_NOT, OP_NOT in front of a popping conditional
+ * jump, runs of OP_POP and jumps that land on other jumps. Jump offsets are
+ * recomputed and every instruction keeps the line it was compiled from.
+ */
+void optimizeChunk(Chunk* chunk) {
+    if (chunk->count == 0) return;
+
+    Program program;
+    decodeChunk(chunk, &program);
+
+    invertNegatedJumps(&program);
+    fuseNegatedComparisons(&program);
+    mergePops(&program);
+    for (int i = 0; i < program.count; i++) {
+        Instruction* jump = &program.code[i];
+        if (isJump(jump)) jump->target = liveFrom(&program, jump->target);
+    }
+    threadJumps(&program);
+
+    int size = layoutProgram(&program);
+    if (size != -1) encodeProgram(&program, chunk, size);
+
+    FREE_ARRAY(Instruction, program.code, program.capacity);
+}
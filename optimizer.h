@@ -0,0 +1,9 @@
+#ifndef fcc_optimizer_h
+#define fcc_optimizer_h
+
+#include "chunk.h"
+
+// function declaration for the peephole optimizer
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -5,9 +5,26 @@
 #include "common.h"
 #include "scanner.h"
 
+#ifdef SIMD_SCANNER
+#ifdef __AVX2__
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
+/**
+ * Structure of the scanner
+ *
+ * start "first character of the token being scanned"
+ * current "next character to scan"
+ * end "the terminating NUL; blocks are only loaded when they end before it"
+ * line "line of current"
+ */
 typedef struct {
     const char* start;
     const char* current;
+    const char* end;
     int line;
 } Scanner;
 
@@ -17,9 +34,145 @@ Scanner scanner;
 void initScanner(const char* source) {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + strlen(source);
     scanner.line = 1;
 }
 
+#ifdef SIMD_SCANNER
+/**
+ * Block scanning
+ *
+ * Each fast path loads the block at scanner.current, builds a bit mask with
+ * one bit per byte that ends the run it is skipping, and jumps to its first
+ * set bit. When no bit is set the whole block is skipped. Newlines passed
+ * over are counted with popcount. The fast paths stop when less than a
+ * block is left before the end, and the byte-at-a-time loops after them
+ * finish the run.
+ */
+#ifdef __AVX2__
+#define BLOCK_SIZE 32
+typedef __m256i Block;
+#define loadBlock(bytes) _mm256_loadu_si256((const __m256i*)(bytes))
+#define splat(c) _mm256_set1_epi8(c)
+#define equalBytes(a, b) _mm256_cmpeq_epi8(a, b)
+#define minBytes(a, b) _mm256_min_epu8(a, b)
+#define subBytes(a, b) _mm256_sub_epi8(a, b)
+#define orBytes(a, b) _mm256_or_si256(a, b)
+#define byteMask(block) ((uint32_t)_mm256_movemask_epi8(block))
+#else
+#define BLOCK_SIZE 16
+typedef __m128i Block;
+#define loadBlock(bytes) _mm_loadu_si128((const __m128i*)(bytes))
+#define splat(c) _mm_set1_epi8(c)
+#define equalBytes(a, b) _mm_cmpeq_epi8(a, b)
+#define minBytes(a, b) _mm_min_epu8(a, b)
+#define subBytes(a, b) _mm_sub_epi8(a, b)
+#define orBytes(a, b) _mm_or_si128(a, b)
+#define byteMask(block) ((uint32_t)_mm_movemask_epi8(block))
+#endif
+
+// mask of the bytes a mask leaves out, within one block
+#define NOT_IN(mask) (~(mask) & (uint32_t)((1ull << BLOCK_SIZE) - 1))
+
+// function to check a whole block fits before the end of the source
+static inline bool blockAhead() {
+    return scanner.end - scanner.current >= BLOCK_SIZE;
+}
+
+// function to get the mask of the bytes equal to c
+static inline uint32_t matchByte(Block block, char c) {
+    return byteMask(equalBytes(block, splat(c)));
+}
+
+// function to get the mask of the bytes in low..low + span (unsigned)
+static inline uint32_t matchRange(Block block, char low, char span) {
+    Block offset = subBytes(block, splat(low));
+    return byteMask(equalBytes(minBytes(offset, splat(span)), offset));
+}
+
+// function to get the mask of the digits
+static inline uint32_t matchDigits(Block block) {
+    return matchRange(block, '0', 9);
+}
+
+// function to get the mask of the letters, digits and underscores
+static inline uint32_t matchIdentifier(Block block) {
+    Block lower = orBytes(block, splat(0x20));
+    return matchRange(lower, 'a', 25) | matchDigits(block) |
+           matchByte(block, '_');
+}
+
+// function to count the set bits of a mask of newlines
+static inline int countLines(uint32_t newlines) {
+#ifdef __POPCNT__
+    return __builtin_popcount(newlines);
+#else
+    // Without the instruction __builtin_popcount is a library call; blocks
+    // rarely hold more than a newline or two.
+    int count = 0;
+    for (; newlines != 0; newlines &= newlines - 1) count++;
+    return count;
+#endif
+}
+
+// function to move past the bytes before the first stop bit, counting lines
+static inline bool skipTo(uint32_t stop, uint32_t newlines) {
+    if (stop == 0) {
+        scanner.line += countLines(newlines);
+        scanner.current += BLOCK_SIZE;
+        return false;
+    }
+
+    int length = __builtin_ctz(stop);
+    scanner.line += countLines(newlines & ((1u << length) - 1));
+    scanner.current += length;
+    return true;
+}
+
+// function to skip spaces, tabs, carriage returns and newlines
+static void skipBlankBlocks() {
+    while (blockAhead()) {
+        Block block = loadBlock(scanner.current);
+        uint32_t newlines = matchByte(block, '\n');
+        uint32_t blanks = newlines | matchByte(block, ' ') |
+                          matchByte(block, '\t') | matchByte(block, '\r');
+        if (skipTo(NOT_IN(blanks), newlines)) return;
+    }
+}
+
+// function to skip a comment up to its newline
+static void skipCommentBlocks() {
+    while (blockAhead()) {
+        Block block = loadBlock(scanner.current);
+        if (skipTo(matchByte(block, '\n'), 0)) return;
+    }
+}
+
+// function to skip the rest of an identifier
+static void skipIdentifierBlocks() {
+    while (blockAhead()) {
+        Block block = loadBlock(scanner.current);
+        if (skipTo(NOT_IN(matchIdentifier(block)), 0)) return;
+    }
+}
+
+// function to skip a run of digits
+static void skipDigitBlocks() {
+    while (blockAhead()) {
+        Block block = loadBlock(scanner.current);
+        if (skipTo(NOT_IN(matchDigits(block)), 0)) return;
+    }
+}
+
+// function to skip a string literal up to its closing quote
+static void skipStringBlocks() {
+    while (blockAhead()) {
+        Block block = loadBlock(scanner.current);
+        if (skipTo(matchByte(block, '"'), matchByte(block, '\n'))) return;
+    }
+}
+#endif
+
 // function to check is alphabet
 static bool isAlpha(char c) {
     return (c >= 'a' && c <= 'z') ||
@@ -95,10 +248,18 @@ static void skipWhitespace() {
             case '\n':
                 scanner.line++;
                 advance();
+#ifdef SIMD_SCANNER
+                // Single blanks between tokens are not worth a block, but
+                // the indentation and blank lines after a newline are.
+                skipBlankBlocks();
+#endif
                 break;
             case '/':
                 if(peekNext() == '/' ){
                     // comment goes until the end of the line.
+#ifdef SIMD_SCANNER
+                    skipCommentBlocks();
+#endif
                     while(peek() != '\n' && !isAtEnd()) advance();
                 } else {
                     return;
@@ -111,59 +272,110 @@ static void skipWhitespace() {
 }
 
 
-// function to check for keyword
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type){
-    if(scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
+/**
+ * Keyword recognition
+ *
+ * Keywords are found with a minimal perfect hash. The slot of a word is its
+ * length plus the associated values of its first and last characters,
+ * modulo the number of keywords, and every keyword has a slot of its own.
+ * An identifier costs one table probe and one compare.
+ *
+ * The compiler fills keywords[] from KEYWORDS(), and the static assert
+ * checks that no two keywords share a slot. A new keyword needs its token
+ * type and a line in KEYWORDS(). If the assert then fails, KEYWORD_ASSOCS()
+ * needs new values: try values for the letters that start or end a
+ * keyword until every slot is distinct.
+ */
+#define KEYWORDS(KEYWORD)                        \
+    KEYWORD("and",    'a', 'd', TOKEN_AND)       \
+    KEYWORD("class",  'c', 's', TOKEN_CLASS)     \
+    KEYWORD("const",  'c', 't', TOKEN_CONST)     \
+    KEYWORD("else",   'e', 'e', TOKEN_ELSE)      \
+    KEYWORD("false",  'f', 'e', TOKEN_FALSE)     \
+    KEYWORD("for",    'f', 'r', TOKEN_FOR)       \
+    KEYWORD("fun",    'f', 'n', TOKEN_FUN)       \
+    KEYWORD("if",     'i', 'f', TOKEN_IF)        \
+    KEYWORD("nil",    'n', 'l', TOKEN_NIL)       \
+    KEYWORD("or",     'o', 'r', TOKEN_OR)        \
+    KEYWORD("print",  'p', 't', TOKEN_PRINT)     \
+    KEYWORD("return", 'r', 'n', TOKEN_RETURN)    \
+    KEYWORD("super",  's', 'r', TOKEN_SUPER)     \
+    KEYWORD("this",   't', 's', TOKEN_THIS)      \
+    KEYWORD("true",   't', 'e', TOKEN_TRUE)      \
+    KEYWORD("var",    'v', 'r', TOKEN_VAR)       \
+    KEYWORD("while",  'w', 'e', TOKEN_WHILE)
 
-    return TOKEN_IDENTIFIER;
-}
+#define KEYWORD_ONE(name, first, last, type) + 1
+enum { KEYWORD_COUNT = 0 KEYWORDS(KEYWORD_ONE) };
+
+// associated value of each character that starts or ends a keyword
+#define KEYWORD_ASSOCS(ASSOC, c) \
+    ASSOC(c, 'c', 4) ASSOC(c, 'd', 14) ASSOC(c, 'l', 11) ASSOC(c, 'n', 4) \
+    ASSOC(c, 'o', 11) ASSOC(c, 'p', 7) ASSOC(c, 's', 3) ASSOC(c, 't', 2) \
+    ASSOC(c, 'v', 12) ASSOC(c, 'w', 11)
+
+#define ASSOC_TERM(c, letter, value) (c) == (letter) ? (value) :
+#define ASSOC_ENTRY(c, letter, value) [letter] = value,
+
+#define KEYWORD_SLOT(length, first, last)                                 \
+    (((length) + (KEYWORD_ASSOCS(ASSOC_TERM, first) 0) +                  \
+      (KEYWORD_ASSOCS(ASSOC_TERM, last) 0)) % KEYWORD_COUNT)
+
+// KEYWORD_ASSOCS() as a table, 0 for the other characters
+static const uint8_t keywordAssoc[UINT8_COUNT] = {
+    KEYWORD_ASSOCS(ASSOC_ENTRY, 0)
+};
+
+/**
+ * Structure of a keyword
+ *
+ * name "the keyword's text"
+ * length "length of name"
+ * type "the token it scans as"
+ */
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+#define KEYWORD_ENTRY(name, first, last, type)                          \
+    [KEYWORD_SLOT(sizeof(name) - 1, first, last)] = {name, sizeof(name) - 1, \
+                                                     type},
+static const Keyword keywords[KEYWORD_COUNT] = {KEYWORDS(KEYWORD_ENTRY)};
+
+#define KEYWORD_BIT(name, first, last, type) \
+    | (1u << KEYWORD_SLOT(sizeof(name) - 1, first, last))
+_Static_assert((0 KEYWORDS(KEYWORD_BIT)) == (1u << KEYWORD_COUNT) - 1,
+               "Two keywords hash to the same slot.");
 
 // function to return identifier type
 static TokenType identifierType(){
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    int length = (int)(scanner.current - scanner.start);
+    int slot = (length + keywordAssoc[(uint8_t)scanner.start[0]] +
+                keywordAssoc[(uint8_t)scanner.current[-1]]) % KEYWORD_COUNT;
+    const Keyword* keyword = &keywords[slot];
+    if (keyword->length == length &&
+        memcmp(scanner.start, keyword->name, length) == 0) {
+        return keyword->type;
     }
     return TOKEN_IDENTIFIER;
 }
 
 // function to handle identifiers
 static Token identifier() {
+#ifdef SIMD_SCANNER
+    skipIdentifierBlocks();
+#endif
     while(isAlpha(peek()) || isDigit(peek())) advance();
     return makeToken(identifierType());
 }
 
 // function to handle number literal
 static Token number() {
+#ifdef SIMD_SCANNER
+    skipDigitBlocks();
+#endif
     while (isDigit(peek())) advance();  
     
     // Look for a fractional part
@@ -171,6 +383,9 @@ static Token number() {
         // consume the ".".
         advance();
 
+#ifdef SIMD_SCANNER
+        skipDigitBlocks();
+#endif
         while(isDigit(peek())) advance();
     }
 
@@ -179,6 +394,9 @@ static Token number() {
 
 // function to handle string literal
 static Token string() {
+#ifdef SIMD_SCANNER
+    skipStringBlocks();
+#endif
     while(peek() != '"' && !isAtEnd()){
         if(peek() == '\n') scanner.line++;
         advance();
@@ -5,6 +5,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -93,6 +94,8 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 
     entry->key = key;
     entry->value = value;
+    writeBarrier(OBJ_VAL(key));
+    writeBarrier(value);
     return isNewKey;
 }
 
@@ -138,4 +141,12 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 
     index = (index + 1) % table->capacity;
   }
-}
\ No newline at end of file
+}
+
+// function to point an entry at the copy of its key that the collector made
+void tableReplaceKey(Table* table, ObjString* key, ObjString* copy) {
+  if (table->count == 0) return;
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key == key) entry->key = copy;
+}
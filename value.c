@@ -41,6 +41,17 @@ void freeValueArray(ValueArray* array) {
  * function to print value
  */
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
  switch (value.type) {
     case VAL_BOOL:
       printf(AS_BOOL(value) ? "true" : "false");
@@ -48,17 +59,27 @@ void printValue(Value value) {
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
+    case VAL_UNDEFINED: break; // Never reaches a script.
   }
+#endif
 }
 
 // function for check value equality
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Compare numbers as doubles so that NaN != NaN and 0 == -0.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED: return true;
     //AS string interns are used no need compare characters byte by byte
     // case VAL_OBJ: {
     //   ObjString* aString = AS_STRING(a);
@@ -68,4 +89,5 @@ bool valuesEqual(Value a, Value b) {
     // }
     default:         return false; // Unreachable.
   }
+#endif
 }
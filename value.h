@@ -1,16 +1,77 @@
 #ifndef fcc_value_h
 #define fcc_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+/**
+ * NaN-boxed representation: every Value is a single 64-bit word.
+ *
+ * Numbers are stored as plain doubles. Anything else hides in the unused
+ * payload of a quiet NaN: nil/true/false use small tags in the low bits,
+ * and objects set the sign bit and keep the Obj pointer in the low 48 bits.
+ */
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL       1 // 001.
+#define TAG_FALSE     2 // 010.
+#define TAG_TRUE      3 // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+// Marks a global slot that has not been defined yet. Never seen by scripts.
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// function to reinterpret a boxed value as a double
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+// function to box a double
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -24,6 +85,7 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
@@ -33,9 +95,12 @@ typedef struct {
 
 #define BOOL_VAL(value)   ((Value) {VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value) {VAL_NIL, {.number = 0}})
+// Marks a global slot that has not been defined yet. Never seen by scripts.
+#define UNDEFINED_VAL     ((Value) {VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value) {VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
 
 typedef struct {
   int capacity;
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
@@ -26,25 +27,93 @@ static void runtimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    int line = getLine(vm.chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
     resetStack();
 }
  
 // function to initialize the VM stack
 void initVM() {
-    resetStack();
+    vm.chunk = NULL;
     vm.objects = NULL;
+    vm.bytesAllocated = 0;
+    vm.nextGC = GC_HEAP_MIN;
+    vm.nextStep = GC_HEAP_MIN;
+    vm.grayCount = 0;
+    vm.grayCapacity = 0;
+    vm.grayStack = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.gcMaxPause = 0;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    vm.nursery = NULL;
+    vm.nurseryTop = NULL;
+    vm.nurseryEnd = NULL;
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
+    resetStack();
+    vm.jit = false;
 
     initTable(&vm.globals);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
+
+    // Everything the collector looks at is set up before the first
+    // allocation, which may collect.
+    reserveStack(STACK_INITIAL);
+    vm.nursery = ALLOCATE(uint8_t, NURSERY_SIZE);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
 }
 
 // function to free VM
 void freeVM() {
     freeTable(&vm.globals);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
     freeObjects();
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    freePools();
+}
+
+/**
+ * function to make sure the stack has room for a number of values
+ *
+ * The compiler works out the deepest the stack gets for each chunk
+ * (maxStack). Growing the stack to that once before the chunk runs is what
+ * lets push() and pop() go without overflow checks.
+ */
+void reserveStack(int slots) {
+    if (slots <= vm.stackCapacity) return;
+
+    int oldCapacity = vm.stackCapacity;
+    int top = (int)(vm.stackTop - vm.stack);
+    vm.stackCapacity = GROW_CAPACITY(oldCapacity);
+    if (vm.stackCapacity < slots) vm.stackCapacity = slots;
+    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+    vm.stackTop = vm.stack + top;
+}
+
+/**
+ * function to get the slot index of a global variable
+ *
+ * Slots are handed out the first time the compiler sees a name and stay
+ * valid for the lifetime of the VM, so REPL lines share them.
+ */
+int globalSlot(ObjString* name) {
+    Value index;
+    if (tableGet(&vm.globals, name, &index)) return (int)AS_NUMBER(index);
+
+    // name may not be reachable yet, and each write below can collect.
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    writeBarrier(OBJ_VAL(name));
+    tableSet(&vm.globals, name, NUMBER_VAL((double)slot));
+    pop();
+    return slot;
 }
 
 // function to push value to stack
@@ -71,165 +140,551 @@ static bool isFalsey(Value value) {
 
 // function to concatenate string
 static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+  // a and b stay on the stack until the result exists, so a collection
+  // while allocating it can neither free them nor move them unnoticed.
+  ObjString* result = concatenateStrings();
+  pop();
+  pop();
+  push(OBJ_VAL(result));
+}
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+// function to compare a loop counter with its limit as OP_FORLOOP's flags say
+static inline bool forCompare(uint8_t flags, double counter, double limit) {
+    // <= and >= are negations, as in the code they replace, so NaN matches.
+    switch (flags & FOR_COMPARE_MASK) {
+        case FOR_LESS:       return counter < limit;
+        case FOR_LESS_EQUAL: return !(counter > limit);
+        case FOR_GREATER:    return counter > limit;
+        default:             return !(counter < limit);
+    }
+}
 
-  ObjString* result = takeString(chars, length);
-  push(OBJ_VAL(result));
+#ifdef DEBUG_TRACE_EXECUTION
+// function to print the stack and the instruction about to be executed
+static void traceExecution() {
+    printf("          ");
+    for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
 }
+#endif
 
 // function to run the VM
 static InterpretResult run() {
-    #define READ_BYTE() (*vm.ip++)
+    // The instruction pointer lives in a local so it can stay in a register;
+    // STORE_IP() writes it back before anything that reads vm.ip.
+    register uint8_t* ip = vm.ip;
+    // The stack cannot move while the chunk runs; interpret() reserved it.
+    Value* slots = vm.stack;
+
+    #define STORE_IP() (vm.ip = ip)
+    #define READ_BYTE() (*ip++)
     #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
     #define READ_SHORT() \
-        (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+        (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+    #define READ_LONG() \
+        (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+    #define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_LONG()])
     #define READ_STRING() AS_STRING(READ_CONSTANT())
-    #define BINARY_OP(valueType, op) \
+    #define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+    #define FOR_LIMIT(flags, limit) \
+        ((flags) & FOR_LIMIT_LOCAL ? slots[limit] \
+                                   : vm.chunk->constants.values[limit])
+    // The global instructions share their bodies with the *_LONG forms,
+    // which only differ in how the slot operand is read.
+    #define GET_GLOBAL(readSlot) \
+        do { \
+            uint32_t slot = readSlot; \
+            Value value = vm.globalValues.values[slot]; \
+            if (IS_UNDEFINED(value)) { \
+                STORE_IP(); \
+                runtimeError("Undefined variable '%s'.", GLOBAL_NAME(slot)); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            push(value); \
+        } while (false)
+    #define DEFINE_GLOBAL(readSlot) \
+        do { \
+            uint32_t slot = readSlot; \
+            vm.globalValues.values[slot] = peek(0); \
+            writeBarrier(peek(0)); \
+            pop(); \
+        } while (false)
+    #define SET_GLOBAL(readSlot) \
+        do { \
+            uint32_t slot = readSlot; \
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) { \
+                STORE_IP(); \
+                runtimeError("Undefined variable '%s'.", GLOBAL_NAME(slot)); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            vm.globalValues.values[slot] = peek(0); \
+            writeBarrier(peek(0)); \
+        } while (false)
+    #define BINARY_OP(valueType, op, quickened) \
         do { \
         if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            STORE_IP(); \
             runtimeError("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
+            QUICKEN(quickened); \
+            double b = AS_NUMBER(pop()); \
+            double a = AS_NUMBER(pop()); \
+            push(valueType(a op b)); \
+        } while (false)
+    // <= and >= are !(a > b) and !(a < b), as the compiler emitted them
+    // before optimizeChunk() fused the OP_NOT in, so NaN compares the same.
+    #define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+    /**
+     * Quickening: once a generic instruction has seen number operands it
+     * rewrites its own opcode in the chunk to the *_NUM form. That form
+     * only checks its guard. If the guard fails, DEOPTIMIZE() puts the
+     * generic opcode back and re-runs it, which also reports any type error.
+     */
+    #define QUICKEN(opcode) (ip[-1] = (opcode))
+    #define DEOPTIMIZE(opcode) (ip[-1] = (opcode), ip--)
+    #define BINARY_OP_NUM(valueType, op, generic) \
+        do { \
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+                double b = AS_NUMBER(pop()); \
+                double a = AS_NUMBER(pop()); \
+                push(valueType(a op b)); \
+            } else { \
+                DEOPTIMIZE(generic); \
+            } \
+        } while (false)
+
+    // The unchecked forms: the compiler proved both operands are numbers.
+    #define BINARY_OP_NN(valueType, op) \
+        do { \
             double b = AS_NUMBER(pop()); \
             double a = AS_NUMBER(pop()); \
             push(valueType(a op b)); \
         } while (false)
 
-    for(;;) {
+    // Every taken backward branch lands on a loop header. With --jit the
+    // loop is counted there and, once hot, continues in machine code.
+#ifdef JIT
+    #define LOOP_BACK(offset) \
+        do { \
+            uint8_t* loopEnd = ip; \
+            ip -= (offset); \
+            if (vm.jit) ip = jitLoop(ip, loopEnd); \
+        } while (false)
+#else
+    #define LOOP_BACK(offset) (ip -= (offset))
+#endif
 
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        printf("[ ");
-        printValue(*slot);
-        printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    #define TRACE_INSTRUCTION() (STORE_IP(), traceExecution())
+#else
+    #define TRACE_INSTRUCTION() ((void)0)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+
+/**
+ * Dispatch comes in two flavours. With COMPUTED_GOTO every handler ends by
+ * jumping straight to the handler of the next opcode through dispatchTable,
+ * so each handler gets its own indirect branch for the CPU to predict.
+ * Otherwise the portable switch inside a for loop is used.
+ */
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [OP_CONSTANT]      = &&label_OP_CONSTANT,
+        [OP_NIL]           = &&label_OP_NIL,
+        [OP_TRUE]          = &&label_OP_TRUE,
+        [OP_FALSE]         = &&label_OP_FALSE,
+        [OP_POP]           = &&label_OP_POP,
+        [OP_GET_LOCAL]     = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL]     = &&label_OP_SET_LOCAL,
+        [OP_GET_GLOBAL]    = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]    = &&label_OP_SET_GLOBAL,
+        [OP_EQUAL]         = &&label_OP_EQUAL,
+        [OP_GREATER]       = &&label_OP_GREATER,
+        [OP_LESS]          = &&label_OP_LESS,
+        [OP_ADD]           = &&label_OP_ADD,
+        [OP_SUBTRACT]      = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY]      = &&label_OP_MULTIPLY,
+        [OP_DIVIDE]        = &&label_OP_DIVIDE,
+        [OP_NOT]           = &&label_OP_NOT,
+        [OP_NEGATE]        = &&label_OP_NEGATE,
+        [OP_PRINT]         = &&label_OP_PRINT,
+        [OP_JUMP]          = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_TRUE]  = &&label_OP_JUMP_IF_TRUE,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_LOOP]          = &&label_OP_LOOP,
+        [OP_POP_LOOP_IF_TRUE]  = &&label_OP_POP_LOOP_IF_TRUE,
+        [OP_FORPREP]       = &&label_OP_FORPREP,
+        [OP_FORLOOP]       = &&label_OP_FORLOOP,
+        [OP_RETURN]        = &&label_OP_RETURN,
+        [OP_CONSTANT_LONG]      = &&label_OP_CONSTANT_LONG,
+        [OP_GET_LOCAL_LONG]     = &&label_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG]     = &&label_OP_SET_LOCAL_LONG,
+        [OP_GET_GLOBAL_LONG]    = &&label_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]    = &&label_OP_SET_GLOBAL_LONG,
+        [OP_JUMP_LONG]          = &&label_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE_LONG] = &&label_OP_JUMP_IF_FALSE_LONG,
+        [OP_JUMP_IF_TRUE_LONG]  = &&label_OP_JUMP_IF_TRUE_LONG,
+        [OP_POP_JUMP_IF_FALSE_LONG] = &&label_OP_POP_JUMP_IF_FALSE_LONG,
+        [OP_LOOP_LONG]          = &&label_OP_LOOP_LONG,
+        [OP_POP_LOOP_IF_TRUE_LONG]  = &&label_OP_POP_LOOP_IF_TRUE_LONG,
+        [OP_POP_JUMP_IF_TRUE_LONG]  = &&label_OP_POP_JUMP_IF_TRUE_LONG,
+        [OP_POP_LOOP_IF_FALSE_LONG] = &&label_OP_POP_LOOP_IF_FALSE_LONG,
+        [OP_NOT_EQUAL]          = &&label_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL]      = &&label_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]         = &&label_OP_LESS_EQUAL,
+        [OP_POPN]               = &&label_OP_POPN,
+        [OP_POP_JUMP_IF_TRUE]   = &&label_OP_POP_JUMP_IF_TRUE,
+        [OP_POP_LOOP_IF_FALSE]  = &&label_OP_POP_LOOP_IF_FALSE,
+        [OP_GREATER_NUM]   = &&label_OP_GREATER_NUM,
+        [OP_LESS_NUM]      = &&label_OP_LESS_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&label_OP_GREATER_EQUAL_NUM,
+        [OP_LESS_EQUAL_NUM]    = &&label_OP_LESS_EQUAL_NUM,
+        [OP_ADD_NUM]       = &&label_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM]  = &&label_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]  = &&label_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]    = &&label_OP_DIVIDE_NUM,
+        [OP_NEGATE_NUM]    = &&label_OP_NEGATE_NUM,
+        [OP_GREATER_NN]    = &&label_OP_GREATER_NN,
+        [OP_LESS_NN]       = &&label_OP_LESS_NN,
+        [OP_GREATER_EQUAL_NN] = &&label_OP_GREATER_EQUAL_NN,
+        [OP_LESS_EQUAL_NN]    = &&label_OP_LESS_EQUAL_NN,
+        [OP_ADD_NN]        = &&label_OP_ADD_NN,
+        [OP_SUBTRACT_NN]   = &&label_OP_SUBTRACT_NN,
+        [OP_MULTIPLY_NN]   = &&label_OP_MULTIPLY_NN,
+        [OP_DIVIDE_NN]     = &&label_OP_DIVIDE_NN,
+        [OP_NEGATE_NN]     = &&label_OP_NEGATE_NN,
+    };
+
+    #define INTERPRET_LOOP DISPATCH();
+    #define CASE(opcode) label_##opcode
+    #define DISPATCH() \
+        do { \
+            TRACE_INSTRUCTION(); \
+            goto *dispatchTable[READ_BYTE()]; \
+        } while (false)
+#else
+    #define INTERPRET_LOOP \
+        for(;;) \
+            switch (TRACE_INSTRUCTION(), READ_BYTE())
+    #define CASE(opcode) case opcode
+    #define DISPATCH() break
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): pop(); DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(slots[slot]); 
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL):    GET_GLOBAL(READ_BYTE()); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): DEFINE_GLOBAL(READ_BYTE()); DISPATCH();
+        CASE(OP_SET_GLOBAL):    SET_GLOBAL(READ_BYTE()); DISPATCH();
+        CASE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                STORE_IP();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]); 
-                break;
+            DISPATCH();
+        }            
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+        CASE(OP_NOT): 
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        CASE(OP_NEGATE): 
+            if(!IS_NUMBER(peek(0))) {
+                STORE_IP();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
-                break;
+            QUICKEN(OP_NEGATE_NUM);
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            printValue(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(pop())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_POP_LOOP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(pop())) LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_FORPREP): {
+            uint8_t slot = READ_BYTE();
+            uint8_t flags = READ_BYTE();
+            uint8_t limitOperand = READ_BYTE();
+            ip++; // The step is only used by OP_FORLOOP.
+            uint16_t offset = READ_SHORT();
+
+            Value counter = slots[slot];
+            Value limit = FOR_LIMIT(flags, limitOperand);
+            if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) {
+                STORE_IP();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            if (!forCompare(flags, AS_NUMBER(counter), AS_NUMBER(limit))) {
+                ip += offset;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            } 
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name); 
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_FORLOOP): {
+            uint8_t slot = READ_BYTE();
+            uint8_t flags = READ_BYTE();
+            uint8_t limitOperand = READ_BYTE();
+            double step = AS_NUMBER(READ_CONSTANT());
+            uint16_t offset = READ_SHORT();
+
+            Value* counter = &slots[slot];
+            if (!IS_NUMBER(*counter)) {
+                // Report what OP_ADD or OP_SUBTRACT would have, on the
+                // increment's line rather than the offset's condition line.
+                vm.ip = ip - 2;
+                runtimeError(flags & FOR_STEP_SUBTRACT
+                                 ? "Operands must be numbers."
+                                 : "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            double next = flags & FOR_STEP_SUBTRACT
+                              ? AS_NUMBER(*counter) - step
+                              : AS_NUMBER(*counter) + step;
+            *counter = NUMBER_VAL(next);
+
+            Value limit = FOR_LIMIT(flags, limitOperand);
+            if (!IS_NUMBER(limit)) {
+                STORE_IP();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                    break;
-            }            
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: 
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE: 
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            if (forCompare(flags, next, AS_NUMBER(limit))) LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            // Exit interpreter
+            return INTERPRET_OK;
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = READ_CONSTANT_LONG();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_LONG): {
+            uint32_t slot = READ_LONG();
+            push(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint32_t slot = READ_LONG();
+            slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_LONG):    GET_GLOBAL(READ_LONG()); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_LONG): DEFINE_GLOBAL(READ_LONG()); DISPATCH();
+        CASE(OP_SET_GLOBAL_LONG):    SET_GLOBAL(READ_LONG()); DISPATCH();
+        CASE(OP_JUMP_LONG): {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (!isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(pop())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG): {
+            uint32_t offset = READ_LONG();
+            LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_POP_LOOP_IF_TRUE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (!isFalsey(pop())) LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_TRUE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (!isFalsey(pop())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_LOOP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(pop())) LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM);
+            DISPATCH();
+        CASE(OP_POPN): vm.stackTop -= READ_BYTE(); DISPATCH();
+        CASE(OP_POP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(pop())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_LOOP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(pop())) LOOP_BACK(offset);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NUM):  BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_NUM):     BINARY_OP_NUM(BOOL_VAL, <, OP_LESS); DISPATCH();
+        CASE(OP_GREATER_EQUAL_NUM):
+            BINARY_OP_NUM(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL_NUM):
+            BINARY_OP_NUM(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+            DISPATCH();
+        CASE(OP_ADD_NUM):      BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_SUBTRACT_NUM): BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):   BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+        CASE(OP_NEGATE_NUM):
+            if (IS_NUMBER(peek(0))) {
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) vm.ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
-                break;
-            }
-            case OP_RETURN: {
-                // Exit interpreter
-                return INTERPRET_OK;
+            } else {
+                DEOPTIMIZE(OP_NEGATE);
             }
-        }
+            DISPATCH();
+        CASE(OP_GREATER_NN):  BINARY_OP_NN(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS_NN):     BINARY_OP_NN(BOOL_VAL, <); DISPATCH();
+        CASE(OP_GREATER_EQUAL_NN): BINARY_OP_NN(NOT_BOOL_VAL, <); DISPATCH();
+        CASE(OP_LESS_EQUAL_NN):    BINARY_OP_NN(NOT_BOOL_VAL, >); DISPATCH();
+        CASE(OP_ADD_NN):      BINARY_OP_NN(NUMBER_VAL, +); DISPATCH();
+        CASE(OP_SUBTRACT_NN): BINARY_OP_NN(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY_NN): BINARY_OP_NN(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE_NN):   BINARY_OP_NN(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NEGATE_NN):
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
     }
 
+    #undef STORE_IP
     #undef READ_BYTE
     #undef READ_SHORT
     #undef READ_CONSTANT
+    #undef READ_LONG
+    #undef READ_CONSTANT_LONG
     #undef READ_STRING
+    #undef GLOBAL_NAME
+    #undef FOR_LIMIT
+    #undef GET_GLOBAL
+    #undef DEFINE_GLOBAL
+    #undef SET_GLOBAL
     #undef BINARY_OP
+    #undef NOT_BOOL_VAL
+    #undef QUICKEN
+    #undef DEOPTIMIZE
+    #undef BINARY_OP_NUM
+    #undef BINARY_OP_NN
+    #undef LOOP_BACK
+    #undef TRACE_INSTRUCTION
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DISPATCH
 }
 
 
+/**
+ * Method to run a compiled chunk, from compile() or a bytecode cache
+ */
+InterpretResult interpretChunk(Chunk* chunk){
+    reserveStack((int)(vm.stackTop - vm.stack) + chunk->maxStack +
+                 STACK_GC_SLOTS);
+    vm.chunk = chunk;
+    vm.ip = vm.chunk->code;
+
+    InterpretResult result = run();
+#ifdef JIT
+    freeJit();
+#endif
+    return result;
+}
+
 /**
  * Method to interpret the source code
  */
@@ -242,10 +697,7 @@ InterpretResult interpret(const char* source){
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
+    InterpretResult result = interpretChunk(&chunk);
 
     freeChunk(&chunk);
     return result;
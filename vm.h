@@ -2,19 +2,101 @@
 #define fcc_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// Values the stack starts with room for; reserveStack() grows it.
+#define STACK_INITIAL UINT8_COUNT
 
+// Values reserved above a chunk's maxStack. An instruction that allocates
+// an object pushes it while it is still being put together (see
+// allocateString()), so the collector can find it.
+#define STACK_GC_SLOTS 1
+
+// Number of power-of-two buckets in the collector's pause time histogram.
+#define GC_PAUSE_BUCKETS 24
+
+/**
+ * Enum for the phase of the major collector
+ *
+ * GC_IDLE "no major cycle under way"
+ * GC_MARK "marking, a few roots per step; writeBarrier() is on"
+ * GC_SWEEP_STRINGS "deleting unmarked strings from vm.strings"
+ * GC_SWEEP "freeing unmarked old objects"
+ */
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP_STRINGS,
+    GC_SWEEP,
+} GcPhase;
+
+/**
+ * Structure of the collector's pause times
+ *
+ * pauses "count of pauses per bucket; bucket i holds those under 2^i us"
+ * pauseCount "number of pauses"
+ * totalPause "nanoseconds spent paused"
+ * maxPause "longest pause in nanoseconds"
+ */
+typedef struct {
+    uint64_t pauses[GC_PAUSE_BUCKETS];
+    uint64_t pauseCount;
+    uint64_t totalPause;
+    uint64_t maxPause;
+} GcStats;
+
+/**
+ * Structure of the virtual machine
+ *
+ * stack "the value stack; push() and pop() never check its bounds"
+ * stackCapacity "number of values allocated for stack"
+ * globals "maps each global name to its slot index (as a number)"
+ * globalValues "value of each global slot, UNDEFINED_VAL until defined"
+ * globalNames "name of each global slot, for error messages"
+ * jit "count loop back-edges and run hot loops as machine code (--jit)"
+ * bytesAllocated "bytes reallocate() has handed out and not had back"
+ * nextGC "bytesAllocated at which the next major cycle starts"
+ * nextStep "bytesAllocated at which the collector next runs"
+ * grayStack "objects marked but not traced yet, for the collector"
+ * gcPhase "phase of the major cycle under way"
+ * gcCursor "next root or vm.strings entry the phase looks at"
+ * gcSweepCapacity "capacity of vm.strings when GC_SWEEP_STRINGS last looked"
+ * sweepLink "link to the next object GC_SWEEP looks at"
+ * gcMaxPause "nanoseconds a collector pause stops at, 0 for no limit"
+ * gcStats "pause times, for --gc-stats"
+ * nursery "region new objects are bump-allocated in (the young generation)"
+ * nurseryTop "where the next young object goes"
+ * nurseryEnd "end of the nursery"
+ */
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+    Value* stack;
+    int stackCapacity;
     Value* stackTop;
     Table globals;
+    ValueArray globalValues;
+    ValueArray globalNames;
     Table strings;
     Obj* objects;
+    bool jit;
+    size_t bytesAllocated;
+    size_t nextGC;
+    size_t nextStep;
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+    GcPhase gcPhase;
+    int gcCursor;
+    int gcSweepCapacity;
+    Obj** sweepLink;
+    uint64_t gcMaxPause;
+    GcStats gcStats;
+    uint8_t* nursery;
+    uint8_t* nurseryTop;
+    uint8_t* nurseryEnd;
 
 } VM;
 
@@ -26,10 +108,24 @@ typedef enum {
 
 extern VM vm;
 
+/**
+ * function to keep the tri-colour invariant when a value is stored in a
+ * root that marking may already have passed
+ *
+ * Strings refer to nothing, so the stores that matter are into the global
+ * slots and names, the constants and tables; tableSet() calls this itself.
+ */
+static inline void writeBarrier(Value value) {
+    if (vm.gcPhase == GC_MARK && IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
 // function declarations for VM
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretChunk(Chunk* chunk);
+int globalSlot(ObjString* name);
+void reserveStack(int slots);
 void push(Value value);
 Value pop();
 